@@ -0,0 +1,320 @@
+#include <chrono>
+#include <new>
+#include "benchmark.h"
+#include "lib/simd.h"
+
+#define REFERENCE_SAMPLE_COUNT 1024
+// Far beyond what any time budget reaches, so the estimates never
+// reuse the random numbers of the reference.
+#define REFERENCE_FIRST_SAMPLE_INDEX (1u << 31)
+#define RAY_QUERY_PASS_COUNT 8
+#define POOL_CHECK_QUERY_COUNT 20000
+#define SIMD_CHECK_SAMPLE_COUNT (1 << 22)
+// The angle range covers many periods, so range reduction is checked
+// beyond the [0, 2 pi) that hemisphere sampling uses.
+#define SIMD_CHECK_MAX_ANGLE 256.0f
+#define SIMD_CHECK_SINCOS_BOUND 1e-6
+// Triangle lanes must round exactly like triangle::Intersect.
+#define SIMD_CHECK_TRIANGLE_BOUND 0.0
+
+static const fp64 TimeBudgets[] = { 0.25, 0.5, 1.0, 2.0, 4.0, 8.0 };
+
+// Keeps the relative error finite in (near) black pixels.
+static const fp64 RelativeErrorEpsilon = 0.01;
+
+struct convergence_error {
+  fp64 RMSE;
+  fp64 RelMSE;
+};
+
+static fp64 GetSeconds() {
+  using namespace std::chrono;
+  return duration<fp64>(steady_clock::now().time_since_epoch()).count();
+}
+
+static convergence_error CalcConvergenceError(accumulation_buffer const *Estimate, v3fp32 const *Reference) {
+  fp64 SquaredErrorSum = 0;
+  fp64 RelativeErrorSum = 0;
+  fp64 Weight = 1.0 / Estimate->SampleCount;
+  memsize PixelCount = Estimate->Resolution.CalcCount();
+  for(memsize I=0; I<PixelCount; ++I) {
+    fp64 Channels[3][2] = {
+      { Estimate->Sums[I].X * Weight, Reference[I].X },
+      { Estimate->Sums[I].Y * Weight, Reference[I].Y },
+      { Estimate->Sums[I].Z * Weight, Reference[I].Z }
+    };
+    for(memsize C=0; C<3; ++C) {
+      fp64 Difference = Channels[C][0] - Channels[C][1];
+      fp64 SquaredError = Difference * Difference;
+      SquaredErrorSum += SquaredError;
+      RelativeErrorSum += SquaredError / (Channels[C][1] * Channels[C][1] + RelativeErrorEpsilon);
+    }
+  }
+
+  convergence_error Result;
+  Result.RMSE = sqrt(SquaredErrorSum / (PixelCount * 3));
+  Result.RelMSE = RelativeErrorSum / (PixelCount * 3);
+  return Result;
+}
+
+static void RenderReference(worker_pool *Pool, scene const *Scene, accumulation_buffer *Accumulation, v3fp32 *Reference) {
+  fprintf(stderr, "Rendering reference with %d samples per pixel...\n", REFERENCE_SAMPLE_COUNT);
+  Accumulation->FirstSampleIndex = REFERENCE_FIRST_SAMPLE_INDEX;
+  ClearAccumulationBuffer(Accumulation);
+  for(memsize I=0; I<REFERENCE_SAMPLE_COUNT; ++I) {
+    AccumulateFrame(Pool, Accumulation, Scene, nullptr);
+  }
+
+  fp32 Weight = 1.0f / Accumulation->SampleCount;
+  memsize PixelCount = Accumulation->Resolution.CalcCount();
+  for(memsize I=0; I<PixelCount; ++I) {
+    Reference[I] = Accumulation->Sums[I] * Weight;
+  }
+}
+
+void RunConvergenceBenchmark(worker_pool *Pool, scene const *Scene, resolution Resolution, char const *ReferencePath) {
+  accumulation_buffer Accumulation;
+  InitAccumulationBuffer(&Accumulation, Resolution);
+  v3fp32 *Reference = new (std::nothrow) v3fp32[Resolution.CalcCount()];
+  ReleaseAssert(Reference != nullptr, "Could not allocate reference image.");
+
+  if(!ReadFloatImage(ReferencePath, Resolution.Dimension, Reference)) {
+    RenderReference(Pool, Scene, &Accumulation, Reference);
+    bool Written = WriteFloatImage(ReferencePath, Resolution.Dimension, Reference);
+    ReleaseAssert(Written, "Could not write reference image.");
+  }
+
+  // Estimates use sample indices from zero, disjoint from the reference.
+  Accumulation.FirstSampleIndex = 0;
+
+  // Efficiency is the inverse of RelMSE x seconds; lower cost is better.
+  printf("budget_s,samples,seconds,rmse,relmse,relmse_x_seconds\n");
+  for(memsize B=0; B<sizeof(TimeBudgets)/sizeof(TimeBudgets[0]); ++B) {
+    ClearAccumulationBuffer(&Accumulation);
+    fp64 StartTime = GetSeconds();
+    fp64 Elapsed;
+    do {
+      AccumulateFrame(Pool, &Accumulation, Scene, nullptr);
+      Elapsed = GetSeconds() - StartTime;
+    } while(Elapsed < TimeBudgets[B]);
+
+    convergence_error Error = CalcConvergenceError(&Accumulation, Reference);
+    printf(
+      "%.2f,%zu,%.3f,%.6g,%.6g,%.6g\n",
+      TimeBudgets[B],
+      Accumulation.SampleCount,
+      Elapsed,
+      Error.RMSE,
+      Error.RelMSE,
+      Error.RelMSE * Elapsed
+    );
+    fflush(stdout);
+  }
+
+  delete[] Reference;
+  TerminateAccumulationBuffer(&Accumulation);
+}
+
+// Unbounded rays from the camera into random directions around the
+// view direction.
+static void GenerateCameraQueries(scene const *Scene, ray_query *Queries, memsize QueryCount) {
+  random_series Series = SeedRandomSeries(0, 0);
+  for(memsize I=0; I<QueryCount; ++I) {
+    v3fp32 Offset(
+      RandomUnilateral(&Series) * 2.0f - 1.0f,
+      RandomUnilateral(&Series) * 2.0f - 1.0f,
+      RandomUnilateral(&Series) * 2.0f - 1.0f
+    );
+    Queries[I].Ray.Origin = Scene->Camera.Position;
+    Queries[I].Ray.Direction = v3fp32::Normalize(Scene->Camera.Direction + Offset);
+    Queries[I].MaxDistance = FP32_MAX;
+  }
+}
+
+void RunRayQueryBenchmark(worker_pool *Pool, scene const *Scene, memsize QueryCount) {
+  ray_query *Queries = new (std::nothrow) ray_query[QueryCount];
+  ray_query_result *Results = new (std::nothrow) ray_query_result[QueryCount];
+  ReleaseAssert(Queries != nullptr && Results != nullptr, "Could not allocate ray queries.");
+  GenerateCameraQueries(Scene, Queries, QueryCount);
+
+  ray_query_mode const Modes[] = { ray_query_mode::closest_hit, ray_query_mode::any_hit };
+  char const *ModeNames[] = { "closest_hit", "any_hit" };
+  printf("mode,rays,seconds,mrays_per_second,hit_rate\n");
+  for(memsize M=0; M<sizeof(Modes)/sizeof(Modes[0]); ++M) {
+    // Untimed pass, so the worker replicas and caches are warm.
+    TraceRayQueries(Pool, Scene, Queries, Results, QueryCount, Modes[M]);
+
+    fp64 StartTime = GetSeconds();
+    for(memsize P=0; P<RAY_QUERY_PASS_COUNT; ++P) {
+      TraceRayQueries(Pool, Scene, Queries, Results, QueryCount, Modes[M]);
+    }
+    fp64 Elapsed = GetSeconds() - StartTime;
+
+    memsize HitCount = 0;
+    for(memsize I=0; I<QueryCount; ++I) {
+      HitCount += Results[I].Hit;
+    }
+    memsize RayCount = QueryCount * RAY_QUERY_PASS_COUNT;
+    printf(
+      "%s,%zu,%.3f,%.3f,%.3f\n",
+      ModeNames[M],
+      RayCount,
+      Elapsed,
+      RayCount / Elapsed / 1e6,
+      static_cast<fp64>(HitCount) / QueryCount
+    );
+    fflush(stdout);
+  }
+
+  delete[] Results;
+  delete[] Queries;
+}
+
+static bool MatchRayQueryResults(ray_query_result const *A, ray_query_result const *B, memsize QueryCount) {
+  for(memsize I=0; I<QueryCount; ++I) {
+    if(A[I].Hit != B[I].Hit) {
+      return false;
+    }
+    if(A[I].Hit && (A[I].ID != B[I].ID || A[I].Distance != B[I].Distance)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool PrintPoolCheckStep(char const *Name, bool Passed) {
+  printf("%s,%s\n", Name, Passed ? "pass" : "fail");
+  return Passed;
+}
+
+bool RunWorkerPoolCheck(scene const *Scene, memsize WorkerCount, worker_pool_options Options) {
+  ray_query *Queries = new (std::nothrow) ray_query[POOL_CHECK_QUERY_COUNT];
+  ray_query_result *Expected = new (std::nothrow) ray_query_result[POOL_CHECK_QUERY_COUNT];
+  ray_query_result *Results = new (std::nothrow) ray_query_result[POOL_CHECK_QUERY_COUNT];
+  ReleaseAssert(Queries != nullptr && Expected != nullptr && Results != nullptr, "Could not allocate ray queries.");
+  GenerateCameraQueries(Scene, Queries, POOL_CHECK_QUERY_COUNT);
+
+  printf("step,result\n");
+  worker_pool First;
+  CreateWorkerPool(&First, WorkerCount, Options);
+  TraceRayQueries(&First, Scene, Queries, Expected, POOL_CHECK_QUERY_COUNT, ray_query_mode::closest_hit);
+  DestroyWorkerPool(&First);
+
+  // Same size as the destroyed pool, so state kept per worker index
+  // instead of per worker would point into freed arenas.
+  worker_pool Second;
+  CreateWorkerPool(&Second, WorkerCount, Options);
+  TraceRayQueries(&Second, Scene, Queries, Results, POOL_CHECK_QUERY_COUNT, ray_query_mode::closest_hit);
+  bool Passed = PrintPoolCheckStep("recreated", MatchRayQueryResults(Expected, Results, POOL_CHECK_QUERY_COUNT));
+
+  // Two live pools must not share worker state either.
+  worker_pool Third;
+  CreateWorkerPool(&Third, WorkerCount, Options);
+  TraceRayQueries(&Third, Scene, Queries, Results, POOL_CHECK_QUERY_COUNT, ray_query_mode::closest_hit);
+  Passed &= PrintPoolCheckStep("concurrent", MatchRayQueryResults(Expected, Results, POOL_CHECK_QUERY_COUNT));
+  TraceRayQueries(&Second, Scene, Queries, Results, POOL_CHECK_QUERY_COUNT, ray_query_mode::closest_hit);
+  Passed &= PrintPoolCheckStep("interleaved", MatchRayQueryResults(Expected, Results, POOL_CHECK_QUERY_COUNT));
+  DestroyWorkerPool(&Third);
+  DestroyWorkerPool(&Second);
+
+  delete[] Results;
+  delete[] Expected;
+  delete[] Queries;
+  return Passed;
+}
+
+struct simd_check_error {
+  fp64 MaxAbs;
+  fp64 MaxRel;
+};
+
+static void AccumulateCheckError(simd_check_error *Error, fp32 Value, fp32 Expected) {
+  fp64 Abs = fabs(static_cast<fp64>(Value) - Expected);
+  fp64 Rel = Expected != 0.0f ? Abs / fabs(Expected) : Abs;
+  if(Abs > Error->MaxAbs) {
+    Error->MaxAbs = Abs;
+  }
+  if(Rel > Error->MaxRel) {
+    Error->MaxRel = Rel;
+  }
+}
+
+static bool PrintCheckError(char const *Name, simd_check_error Error, fp64 Measured, fp64 Bound) {
+  bool Passed = Measured <= Bound;
+  printf(
+    "%s,%d,%.3g,%.3g,%.3g,%s\n",
+    Name,
+    SIMD_CHECK_SAMPLE_COUNT,
+    Error.MaxAbs,
+    Error.MaxRel,
+    Bound,
+    Passed ? "pass" : "fail"
+  );
+  return Passed;
+}
+
+static v3fp32 RandomInUnitCube(random_series *Random) {
+  v3fp32 Result;
+  Result.X = RandomUnilateral(Random) * 2.0f - 1.0f;
+  Result.Y = RandomUnilateral(Random) * 2.0f - 1.0f;
+  Result.Z = RandomUnilateral(Random) * 2.0f - 1.0f;
+  return Result;
+}
+
+bool RunSIMDAccuracyCheck() {
+  simd_check_error SinError = {};
+  simd_check_error CosError = {};
+  simd_check_error TriangleError = {};
+  random_series Random = SeedRandomSeries(0, 0);
+
+  for(memsize Batch=0; Batch<SIMD_CHECK_SAMPLE_COUNT; Batch+=SIMD_WIDTH) {
+    fp32 Angles[SIMD_WIDTH];
+    for(memsize Lane=0; Lane<SIMD_WIDTH; ++Lane) {
+      fp32 T = static_cast<fp32>(Batch + Lane) / SIMD_CHECK_SAMPLE_COUNT;
+      Angles[Lane] = (T * 2.0f - 1.0f) * SIMD_CHECK_MAX_ANGLE;
+    }
+
+    fp32x4 Sin, Cos;
+    SinCosFP32x4(LoadFP32x4(Angles), &Sin, &Cos);
+    fp32 Sins[SIMD_WIDTH], Coss[SIMD_WIDTH];
+    StoreFP32x4(Sins, Sin);
+    StoreFP32x4(Coss, Cos);
+
+    // Random triangles in the unit cube, hit from outside it.
+    triangle Triangles[SIMD_WIDTH];
+    triangle const *TrianglePointers[SIMD_WIDTH];
+    for(memsize Lane=0; Lane<SIMD_WIDTH; ++Lane) {
+      for(memsize V=0; V<3; ++V) {
+        Triangles[Lane].Vertices[V] = RandomInUnitCube(&Random);
+      }
+      TrianglePointers[Lane] = Triangles + Lane;
+    }
+    ray Ray;
+    Ray.Origin = RandomInUnitCube(&Random) * 2.0f - v3fp32(0.0f, 0.0f, 3.0f);
+    Ray.Direction = v3fp32::Normalize(RandomInUnitCube(&Random) - Ray.Origin);
+    fp32 Distances[SIMD_WIDTH];
+    triangle_batch TriangleBatch;
+    LoadTriangleBatch(&TriangleBatch, TrianglePointers);
+    ui32 HitMask = IntersectTriangleBatch(&TriangleBatch, Ray, Distances);
+
+    for(memsize Lane=0; Lane<SIMD_WIDTH; ++Lane) {
+      AccumulateCheckError(&SinError, Sins[Lane], sinf(Angles[Lane]));
+      AccumulateCheckError(&CosError, Coss[Lane], cosf(Angles[Lane]));
+
+      // Misses count as distance -1, so a differing hit is an error.
+      fp32 Expected;
+      if(!Triangles[Lane].Intersect(Ray, &Expected)) {
+        Expected = -1.0f;
+      }
+      AccumulateCheckError(&TriangleError, ((HitMask >> Lane) & 1) ? Distances[Lane] : -1.0f, Expected);
+    }
+  }
+
+  // Sine and cosine are bounded by their absolute error, since the
+  // relative error is meaningless near their zeros.
+  printf("function,samples,max_abs_error,max_rel_error,bound,result\n");
+  bool Passed = PrintCheckError("sin", SinError, SinError.MaxAbs, SIMD_CHECK_SINCOS_BOUND);
+  Passed &= PrintCheckError("cos", CosError, CosError.MaxAbs, SIMD_CHECK_SINCOS_BOUND);
+  Passed &= PrintCheckError("triangle", TriangleError, TriangleError.MaxAbs, SIMD_CHECK_TRIANGLE_BOUND);
+  return Passed;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "rendering.h"
+
+// Renders the scene progressively at increasing time budgets and
+// prints the error against a high sample count reference as CSV, so
+// sampling and scheduling changes can be compared by efficiency rather
+// than by frame time alone. The reference is loaded from
+// ReferencePath, or rendered and stored there when missing.
+// Rendering must already be initialized with Resolution.
+void RunConvergenceBenchmark(worker_pool *Pool, scene const *Scene, resolution Resolution, char const *ReferencePath);
+
+// Measures the throughput of TraceRayQueries, apart from shading and
+// image output. Casts QueryCount rays from the camera into random
+// directions around the view direction and prints one CSV row per
+// query mode.
+void RunRayQueryBenchmark(worker_pool *Pool, scene const *Scene, memsize QueryCount);
+
+// Traces the same ray queries on a pool, on a second pool of the same
+// size created after the first is destroyed, and on two live pools at
+// once. Prints one CSV row per step and returns false when any result
+// differs from the first. Meant to be run under AddressSanitizer.
+bool RunWorkerPoolCheck(scene const *Scene, memsize WorkerCount, worker_pool_options Options);
+
+// Compares SinCosFP32x4 against sinf and cosf over a dense sweep of
+// angles, and IntersectTriangleBatch against triangle::Intersect on
+// random triangles. Prints the largest errors as CSV and returns false
+// when an error exceeds its bound.
+bool RunSIMDAccuracyCheck();
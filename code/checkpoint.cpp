@@ -0,0 +1,160 @@
+#include <atomic>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_SLOT_COUNT 2
+
+struct checkpoint_header {
+  char Magic[4];
+  ui32 Version;
+  ui16 Width;
+  ui16 Height;
+  ui32 SlotCount;
+};
+
+// Followed by the sums. A zero sample count marks a slot that holds no
+// complete checkpoint.
+struct checkpoint_slot_header {
+  ui64 SampleCount;
+  ui64 Reserved;
+};
+
+static memsize CalcSlotSize(resolution Resolution) {
+  return sizeof(checkpoint_slot_header) + Resolution.CalcCount() * sizeof(v3fp32);
+}
+
+static memsize CalcCheckpointSize(resolution Resolution) {
+  return sizeof(checkpoint_header) + CHECKPOINT_SLOT_COUNT * CalcSlotSize(Resolution);
+}
+
+static checkpoint_slot_header* GetSlot(render_checkpoint *Checkpoint, memsize Slot) {
+  ui8 *Base = Checkpoint->Mapping + sizeof(checkpoint_header) + Slot * CalcSlotSize(Checkpoint->Resolution);
+  return reinterpret_cast<checkpoint_slot_header*>(Base);
+}
+
+static v3fp32* GetSlotSums(checkpoint_slot_header *Slot) {
+  return reinterpret_cast<v3fp32*>(Slot + 1);
+}
+
+static bool MapCheckpoint(render_checkpoint *Checkpoint, int FileDescriptor, resolution Resolution) {
+  memsize Size = CalcCheckpointSize(Resolution);
+  void *Mapping = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+  if(Mapping == MAP_FAILED) {
+    close(FileDescriptor);
+    return false;
+  }
+
+  Checkpoint->FileDescriptor = FileDescriptor;
+  Checkpoint->Mapping = static_cast<ui8*>(Mapping);
+  Checkpoint->MappingSize = Size;
+  Checkpoint->Resolution = Resolution;
+  Checkpoint->NextSlot = 0;
+  return true;
+}
+
+bool CreateRenderCheckpoint(render_checkpoint *Checkpoint, char const *Path, resolution Resolution) {
+  int FileDescriptor = open(Path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(FileDescriptor == -1) {
+    return false;
+  }
+  // The file starts out sparse and zeroed, i.e. with empty slots.
+  if(ftruncate(FileDescriptor, CalcCheckpointSize(Resolution)) != 0) {
+    close(FileDescriptor);
+    return false;
+  }
+  if(!MapCheckpoint(Checkpoint, FileDescriptor, Resolution)) {
+    return false;
+  }
+
+  checkpoint_header *Header = reinterpret_cast<checkpoint_header*>(Checkpoint->Mapping);
+  memcpy(Header->Magic, "CKPT", 4);
+  Header->Version = CHECKPOINT_VERSION;
+  Header->Width = Resolution.Dimension.X;
+  Header->Height = Resolution.Dimension.Y;
+  Header->SlotCount = CHECKPOINT_SLOT_COUNT;
+  return true;
+}
+
+bool OpenRenderCheckpoint(render_checkpoint *Checkpoint, char const *Path, resolution Resolution) {
+  int FileDescriptor = open(Path, O_RDWR);
+  if(FileDescriptor == -1) {
+    return false;
+  }
+  struct stat Stat;
+  if(fstat(FileDescriptor, &Stat) != 0 || static_cast<memsize>(Stat.st_size) != CalcCheckpointSize(Resolution)) {
+    close(FileDescriptor);
+    return false;
+  }
+  if(!MapCheckpoint(Checkpoint, FileDescriptor, Resolution)) {
+    return false;
+  }
+
+  checkpoint_header const *Header = reinterpret_cast<checkpoint_header*>(Checkpoint->Mapping);
+  bool Valid = memcmp(Header->Magic, "CKPT", 4) == 0 &&
+    Header->Version == CHECKPOINT_VERSION &&
+    Header->Width == Resolution.Dimension.X &&
+    Header->Height == Resolution.Dimension.Y &&
+    Header->SlotCount == CHECKPOINT_SLOT_COUNT;
+  if(!Valid) {
+    CloseRenderCheckpoint(Checkpoint);
+  }
+  return Valid;
+}
+
+bool RestoreRenderCheckpoint(render_checkpoint *Checkpoint, accumulation_buffer *Accumulation) {
+  DebugAssert(Accumulation->Resolution.CalcCount() == Checkpoint->Resolution.CalcCount());
+
+  memsize Newest = 0;
+  for(memsize I=1; I<CHECKPOINT_SLOT_COUNT; ++I) {
+    if(GetSlot(Checkpoint, I)->SampleCount > GetSlot(Checkpoint, Newest)->SampleCount) {
+      Newest = I;
+    }
+  }
+  checkpoint_slot_header *Slot = GetSlot(Checkpoint, Newest);
+  if(Slot->SampleCount == 0) {
+    return false;
+  }
+
+  memcpy(Accumulation->Sums, GetSlotSums(Slot), Checkpoint->Resolution.CalcCount() * sizeof(v3fp32));
+  Accumulation->SampleCount = Slot->SampleCount;
+  Checkpoint->NextSlot = (Newest + 1) % CHECKPOINT_SLOT_COUNT;
+  return true;
+}
+
+// Only the death of this process has to be survived, not that of the
+// machine: stores that are done sit in the page cache and reach the
+// file regardless. Hence compiler fences are enough to order the slot
+// invalidation, the sums and the final sample count. The workers that
+// write the sums are joined by the pool before the commit.
+v3fp32* BeginRenderCheckpoint(render_checkpoint *Checkpoint) {
+  checkpoint_slot_header *Slot = GetSlot(Checkpoint, Checkpoint->NextSlot);
+  Slot->SampleCount = 0;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  return GetSlotSums(Slot);
+}
+
+void CommitRenderCheckpoint(render_checkpoint *Checkpoint, memsize SampleCount) {
+  DebugAssert(SampleCount != 0);
+
+  checkpoint_slot_header *Slot = GetSlot(Checkpoint, Checkpoint->NextSlot);
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  Slot->SampleCount = SampleCount;
+
+  memsize PageSize = sysconf(_SC_PAGESIZE);
+  memsize Begin = reinterpret_cast<memsize>(Slot) & ~(PageSize - 1);
+  memsize End = reinterpret_cast<memsize>(Slot) + CalcSlotSize(Checkpoint->Resolution);
+  msync(reinterpret_cast<void*>(Begin), End - Begin, MS_ASYNC);
+
+  Checkpoint->NextSlot = (Checkpoint->NextSlot + 1) % CHECKPOINT_SLOT_COUNT;
+}
+
+void CloseRenderCheckpoint(render_checkpoint *Checkpoint) {
+  munmap(Checkpoint->Mapping, Checkpoint->MappingSize);
+  close(Checkpoint->FileDescriptor);
+  Checkpoint->Mapping = nullptr;
+}
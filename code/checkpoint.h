@@ -0,0 +1,33 @@
+#pragma once
+
+#include "rendering.h"
+
+// Accumulation state of a progressive render in a memory-mapped file.
+// Per-pixel random series are seeded from the sample index, so the
+// sums and the sample count are all the state there is; resuming from
+// a checkpoint gives bit-identical results to an uninterrupted render.
+//
+// The file holds two slots which are written alternately. A process
+// that is killed in the middle of a checkpoint still leaves the
+// previous one intact.
+struct render_checkpoint {
+  int FileDescriptor;
+  ui8 *Mapping;
+  memsize MappingSize;
+  resolution Resolution;
+  memsize NextSlot;
+};
+
+// Creates a new, empty checkpoint file, replacing any existing one.
+bool CreateRenderCheckpoint(render_checkpoint *Checkpoint, char const *Path, resolution Resolution);
+// Fails if the file does not exist or was made for another resolution.
+bool OpenRenderCheckpoint(render_checkpoint *Checkpoint, char const *Path, resolution Resolution);
+// Loads the newest complete slot. Returns false if there is none.
+bool RestoreRenderCheckpoint(render_checkpoint *Checkpoint, accumulation_buffer *Accumulation);
+// Invalidates the older slot and returns its sums, for AccumulateFrame
+// to fill tile by tile while it renders the next pass.
+v3fp32* BeginRenderCheckpoint(render_checkpoint *Checkpoint);
+// Marks the slot filled since BeginRenderCheckpoint as complete and
+// starts writeback without waiting for it.
+void CommitRenderCheckpoint(render_checkpoint *Checkpoint, memsize SampleCount);
+void CloseRenderCheckpoint(render_checkpoint *Checkpoint);
@@ -0,0 +1,425 @@
+#include <algorithm>
+#include <new>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "geometry_stream.h"
+
+static const ui32 GeometryFileMagic = 0x4d4f4547; // "GEOM"
+static const ui32 GeometryFileVersion = 2;
+
+// Followed by the node table, the chunk table and the triangles.
+struct geometry_file_header {
+  ui32 Magic;
+  ui32 Version;
+  ui64 TriangleSize;
+  ui64 NodeCount;
+  ui64 ChunkCount;
+  ui64 ChunkTriangleCapacity;
+};
+
+static fp32 GetAxis(v3fp32 V, memsize Axis) {
+  switch(Axis) {
+    case 0: return V.X;
+    case 1: return V.Y;
+    default: return V.Z;
+  }
+}
+
+static v3fp32 CalcCentroid(triangle const &T) {
+  return (T.Vertices[0] + T.Vertices[1] + T.Vertices[2]) * (1.0f / 3.0f);
+}
+
+static void CalcBounds(triangle const *Triangles, memsize Count, v3fp32 *Min, v3fp32 *Max) {
+  Min->Set(FP32_MAX);
+  Max->Set(-FP32_MAX);
+  for(memsize I=0; I<Count; ++I) {
+    for(memsize V=0; V<3; ++V) {
+      v3fp32 P = Triangles[I].Vertices[V];
+      Min->Set(MinFP32(Min->X, P.X), MinFP32(Min->Y, P.Y), MinFP32(Min->Z, P.Z));
+      Max->Set(MaxFP32(Max->X, P.X), MaxFP32(Max->Y, P.Y), MaxFP32(Max->Z, P.Z));
+    }
+  }
+}
+
+struct chunk_split_output {
+  geometry_chunk_info *Chunks;
+  memsize ChunkCount;
+  geometry_chunk_node *Nodes;
+  memsize NodeCount;
+};
+
+// Splits the triangles at the centroid median along the longest axis
+// until every range fits in one chunk. Reorders Triangles in place,
+// appends one node per split and one node and chunk per leaf range.
+// Returns the index of the range's node.
+static memsize SplitChunks(
+  triangle *Triangles,
+  memsize Begin,
+  memsize End,
+  memsize ChunkTriangleCapacity,
+  chunk_split_output *Output
+) {
+  memsize Count = End - Begin;
+  v3fp32 Min, Max;
+  CalcBounds(Triangles + Begin, Count, &Min, &Max);
+
+  memsize NodeIndex = Output->NodeCount++;
+  geometry_chunk_node *Node = Output->Nodes + NodeIndex;
+  Node->BoundsMin = Min;
+  Node->BoundsMax = Max;
+
+  if(Count <= ChunkTriangleCapacity) {
+    Node->Index = Output->ChunkCount;
+    Node->SplitAxis = GEOMETRY_NODE_LEAF;
+
+    geometry_chunk_info *Chunk = Output->Chunks + Output->ChunkCount++;
+    Chunk->BoundsMin = Min;
+    Chunk->BoundsMax = Max;
+    Chunk->Offset = Begin;
+    Chunk->TriangleCount = Count;
+    return NodeIndex;
+  }
+
+  v3fp32 Extent = Max - Min;
+  memsize Axis = 0;
+  if(Extent.Y > GetAxis(Extent, Axis)) {
+    Axis = 1;
+  }
+  if(Extent.Z > GetAxis(Extent, Axis)) {
+    Axis = 2;
+  }
+
+  memsize Middle = Begin + Count / 2;
+  std::nth_element(
+    Triangles + Begin,
+    Triangles + Middle,
+    Triangles + End,
+    [Axis](triangle const &A, triangle const &B) {
+      return GetAxis(CalcCentroid(A), Axis) < GetAxis(CalcCentroid(B), Axis);
+    }
+  );
+
+  Node->SplitAxis = Axis;
+  SplitChunks(Triangles, Begin, Middle, ChunkTriangleCapacity, Output);
+  Node->Index = SplitChunks(Triangles, Middle, End, ChunkTriangleCapacity, Output);
+  return NodeIndex;
+}
+
+bool WriteGeometryFile(char const *Path, triangle const *Triangles, memsize TriangleCount, memsize ChunkTriangleCapacity) {
+  DebugAssert(ChunkTriangleCapacity != 0);
+
+  // Median splits never produce more than twice the minimum chunk count.
+  memsize MaxChunkCount = 2 * ((TriangleCount + ChunkTriangleCapacity - 1) / ChunkTriangleCapacity) + 1;
+  if(2 * MaxChunkCount > UINT32_MAX) {
+    return false;
+  }
+
+  chunk_split_output Output;
+  Output.Chunks = new (std::nothrow) geometry_chunk_info[MaxChunkCount];
+  Output.ChunkCount = 0;
+  Output.Nodes = new (std::nothrow) geometry_chunk_node[2 * MaxChunkCount];
+  Output.NodeCount = 0;
+  triangle *Sorted = new (std::nothrow) triangle[TriangleCount];
+  ReleaseAssert(Sorted != nullptr && Output.Chunks != nullptr && Output.Nodes != nullptr, "Could not allocate geometry chunks.");
+
+  std::copy(Triangles, Triangles + TriangleCount, Sorted);
+  if(TriangleCount != 0) {
+    SplitChunks(Sorted, 0, TriangleCount, ChunkTriangleCapacity, &Output);
+  }
+  DebugAssert(Output.ChunkCount <= MaxChunkCount);
+
+  // Chunk offsets become byte offsets into the file.
+  memsize DataOffset = (
+    sizeof(geometry_file_header) +
+    sizeof(geometry_chunk_node) * Output.NodeCount +
+    sizeof(geometry_chunk_info) * Output.ChunkCount
+  );
+  for(memsize I=0; I<Output.ChunkCount; ++I) {
+    Output.Chunks[I].Offset = DataOffset + Output.Chunks[I].Offset * sizeof(triangle);
+  }
+
+  geometry_file_header Header;
+  Header.Magic = GeometryFileMagic;
+  Header.Version = GeometryFileVersion;
+  Header.TriangleSize = sizeof(triangle);
+  Header.NodeCount = Output.NodeCount;
+  Header.ChunkCount = Output.ChunkCount;
+  Header.ChunkTriangleCapacity = ChunkTriangleCapacity;
+
+  bool Result = false;
+  FILE *File = fopen(Path, "wb");
+  if(File) {
+    Result = (
+      fwrite(&Header, sizeof(Header), 1, File) == 1 &&
+      fwrite(Output.Nodes, sizeof(geometry_chunk_node), Output.NodeCount, File) == Output.NodeCount &&
+      fwrite(Output.Chunks, sizeof(geometry_chunk_info), Output.ChunkCount, File) == Output.ChunkCount &&
+      fwrite(Sorted, sizeof(triangle), TriangleCount, File) == TriangleCount
+    );
+    Result = fclose(File) == 0 && Result;
+  }
+
+  delete[] Sorted;
+  delete[] Output.Nodes;
+  delete[] Output.Chunks;
+  return Result;
+}
+
+// Rays walk the tree without bounds checks, so a file must only link
+// forward to nodes and chunks that exist, and stay within the depth
+// the traversal stack allows.
+static bool IsValidChunkTree(geometry_stream const *Stream) {
+  if(Stream->NodeCount == 0) {
+    return true;
+  }
+
+  ui32 *Depths = new (std::nothrow) ui32[Stream->NodeCount];
+  ReleaseAssert(Depths != nullptr, "Could not allocate geometry tree check.");
+  std::fill(Depths, Depths + Stream->NodeCount, 0);
+  Depths[0] = 1;
+
+  bool Valid = true;
+  for(memsize I=0; I<Stream->NodeCount && Valid; ++I) {
+    geometry_chunk_node const *Node = Stream->Nodes + I;
+    if(Node->SplitAxis == GEOMETRY_NODE_LEAF) {
+      Valid = Node->Index < Stream->ChunkCount;
+    }
+    else {
+      Valid = (
+        Node->SplitAxis < 3 &&
+        Node->Index > I + 1 &&
+        Node->Index < Stream->NodeCount &&
+        Depths[I] < GEOMETRY_TREE_MAX_DEPTH
+      );
+      if(Valid) {
+        Depths[I + 1] = std::max(Depths[I + 1], Depths[I] + 1);
+        Depths[Node->Index] = std::max(Depths[Node->Index], Depths[I] + 1);
+      }
+    }
+  }
+
+  delete[] Depths;
+  return Valid;
+}
+
+bool OpenGeometryStream(geometry_stream *Stream, char const *Path) {
+  Stream->FileDescriptor = open(Path, O_RDONLY);
+  if(Stream->FileDescriptor == -1) {
+    return false;
+  }
+
+  geometry_file_header Header;
+  bool Valid = (
+    pread(Stream->FileDescriptor, &Header, sizeof(Header), 0) == sizeof(Header) &&
+    Header.Magic == GeometryFileMagic &&
+    Header.Version == GeometryFileVersion &&
+    Header.TriangleSize == sizeof(triangle) &&
+    // A binary tree over the chunks.
+    Header.NodeCount == (Header.ChunkCount ? 2 * Header.ChunkCount - 1 : 0)
+  );
+  if(!Valid) {
+    close(Stream->FileDescriptor);
+    return false;
+  }
+
+  Stream->NodeCount = Header.NodeCount;
+  Stream->Nodes = new (std::nothrow) geometry_chunk_node[Stream->NodeCount];
+  Stream->ChunkCount = Header.ChunkCount;
+  Stream->ChunkTriangleCapacity = Header.ChunkTriangleCapacity;
+  Stream->Chunks = new (std::nothrow) geometry_chunk_info[Stream->ChunkCount];
+  ReleaseAssert(Stream->Nodes != nullptr && Stream->Chunks != nullptr, "Could not allocate geometry chunk table.");
+
+  memsize NodeTableSize = sizeof(geometry_chunk_node) * Stream->NodeCount;
+  memsize ChunkTableSize = sizeof(geometry_chunk_info) * Stream->ChunkCount;
+  bool Read = (
+    pread(Stream->FileDescriptor, Stream->Nodes, NodeTableSize, sizeof(Header)) == static_cast<ssize_t>(NodeTableSize) &&
+    pread(Stream->FileDescriptor, Stream->Chunks, ChunkTableSize, sizeof(Header) + NodeTableSize) == static_cast<ssize_t>(ChunkTableSize)
+  );
+  if(!Read || !IsValidChunkTree(Stream)) {
+    CloseGeometryStream(Stream);
+    return false;
+  }
+
+  return true;
+}
+
+void CloseGeometryStream(geometry_stream *Stream) {
+  close(Stream->FileDescriptor);
+  Stream->FileDescriptor = -1;
+  delete[] Stream->Nodes;
+  Stream->Nodes = nullptr;
+  Stream->NodeCount = 0;
+  delete[] Stream->Chunks;
+  Stream->Chunks = nullptr;
+  Stream->ChunkCount = 0;
+}
+
+// Table entries per slot, rounded up to a power of two. Keeps the load
+// factor at or below one half.
+#define SLOT_TABLE_SCALE 2
+// Covers the alignment padding of the cache's arena pushes.
+#define GEOMETRY_CACHE_PADDING 64
+
+static memsize CalcSlotTableSize(memsize SlotCount) {
+  memsize Size = 1;
+  while(Size < SlotCount * SLOT_TABLE_SCALE) {
+    Size *= 2;
+  }
+  return Size;
+}
+
+static memsize HashChunkIndex(geometry_cache const *Cache, memsize ChunkIndex) {
+  return (static_cast<ui64>(ChunkIndex) * 0x9E3779B97F4A7C15ull >> 32) & Cache->SlotTableMask;
+}
+
+// Returns the table entry that holds ChunkIndex, or the free entry
+// where it belongs.
+static memsize FindSlotEntry(geometry_cache const *Cache, memsize ChunkIndex) {
+  memsize Entry = HashChunkIndex(Cache, ChunkIndex);
+  for(;;) {
+    memsize Slot = Cache->SlotTable[Entry];
+    if(Slot == MEMSIZE_MAX || Cache->SlotChunks[Slot] == ChunkIndex) {
+      return Entry;
+    }
+    Entry = (Entry + 1) & Cache->SlotTableMask;
+  }
+}
+
+// Backward shift deletion: later entries of the same probe run move up
+// into the hole, so lookups never need tombstones.
+static void RemoveSlotEntry(geometry_cache *Cache, memsize Entry) {
+  memsize Mask = Cache->SlotTableMask;
+  memsize Hole = Entry;
+  for(memsize Next=(Hole + 1) & Mask; Cache->SlotTable[Next] != MEMSIZE_MAX; Next=(Next + 1) & Mask) {
+    memsize Home = HashChunkIndex(Cache, Cache->SlotChunks[Cache->SlotTable[Next]]);
+    if(((Next - Home) & Mask) >= ((Next - Hole) & Mask)) {
+      Cache->SlotTable[Hole] = Cache->SlotTable[Next];
+      Hole = Next;
+    }
+  }
+  Cache->SlotTable[Hole] = MEMSIZE_MAX;
+}
+
+static void UnlinkSlot(geometry_cache *Cache, memsize Slot) {
+  memsize Previous = Cache->SlotPrevious[Slot];
+  memsize Next = Cache->SlotNext[Slot];
+  if(Previous != MEMSIZE_MAX) {
+    Cache->SlotNext[Previous] = Next;
+  }
+  else {
+    Cache->FirstUsedSlot = Next;
+  }
+  if(Next != MEMSIZE_MAX) {
+    Cache->SlotPrevious[Next] = Previous;
+  }
+  else {
+    Cache->LastUsedSlot = Previous;
+  }
+}
+
+static void LinkSlotFirst(geometry_cache *Cache, memsize Slot) {
+  Cache->SlotPrevious[Slot] = MEMSIZE_MAX;
+  Cache->SlotNext[Slot] = Cache->FirstUsedSlot;
+  if(Cache->FirstUsedSlot != MEMSIZE_MAX) {
+    Cache->SlotPrevious[Cache->FirstUsedSlot] = Slot;
+  }
+  else {
+    Cache->LastUsedSlot = Slot;
+  }
+  Cache->FirstUsedSlot = Slot;
+}
+
+static void TouchSlot(geometry_cache *Cache, memsize Slot) {
+  if(Cache->FirstUsedSlot != Slot) {
+    UnlinkSlot(Cache, Slot);
+    LinkSlotFirst(Cache, Slot);
+  }
+}
+
+void InitGeometryCache(geometry_cache *Cache, geometry_stream const *Stream, memsize ByteBudget, memory_arena *Arena) {
+  memsize SlotBatchCount = (Stream->ChunkTriangleCapacity + SIMD_WIDTH - 1) / SIMD_WIDTH;
+  memsize SlotSize = sizeof(triangle) * Stream->ChunkTriangleCapacity + sizeof(triangle_batch) * SlotBatchCount;
+  // Worst case of the table is just under twice SLOT_TABLE_SCALE
+  // entries per slot.
+  memsize SlotCost = SlotSize + 3 * sizeof(memsize) + 2 * SLOT_TABLE_SCALE * sizeof(memsize);
+  memsize UsableBudget = ByteBudget > GEOMETRY_CACHE_PADDING ? ByteBudget - GEOMETRY_CACHE_PADDING : 0;
+  Cache->Stream = Stream;
+  Cache->SlotCount = MinMemsize(UsableBudget / SlotCost, Stream->ChunkCount);
+  ReleaseAssert(Cache->SlotCount != 0 || Stream->ChunkCount == 0, "Geometry cache budget is smaller than one chunk.");
+
+  memsize SlotTableSize = CalcSlotTableSize(Cache->SlotCount);
+  Cache->SlotTriangles = MemoryArenaPushArray(Arena, triangle, Cache->SlotCount * Stream->ChunkTriangleCapacity);
+  Cache->SlotBatches = MemoryArenaPushArray(Arena, triangle_batch, Cache->SlotCount * SlotBatchCount);
+  Cache->SlotBatchCount = SlotBatchCount;
+  Cache->SlotChunks = MemoryArenaPushArray(Arena, memsize, Cache->SlotCount);
+  Cache->SlotPrevious = MemoryArenaPushArray(Arena, memsize, Cache->SlotCount);
+  Cache->SlotNext = MemoryArenaPushArray(Arena, memsize, Cache->SlotCount);
+  Cache->SlotTable = MemoryArenaPushArray(Arena, memsize, SlotTableSize);
+  Cache->SlotTableMask = SlotTableSize - 1;
+
+  // Empty slots start out as the least recently used ones.
+  Cache->FirstUsedSlot = MEMSIZE_MAX;
+  Cache->LastUsedSlot = MEMSIZE_MAX;
+  for(memsize I=0; I<Cache->SlotCount; ++I) {
+    Cache->SlotChunks[I] = MEMSIZE_MAX;
+    LinkSlotFirst(Cache, I);
+  }
+  for(memsize I=0; I<SlotTableSize; ++I) {
+    Cache->SlotTable[I] = MEMSIZE_MAX;
+  }
+
+  Cache->Stats.Hits = 0;
+  Cache->Stats.Misses = 0;
+  Cache->Stats.BytesRead = 0;
+}
+
+// The returned triangles stay valid until the next call.
+static cached_geometry_chunk GetSlotChunk(geometry_cache const *Cache, memsize Slot) {
+  cached_geometry_chunk Result;
+  Result.Triangles = Cache->SlotTriangles + Slot * Cache->Stream->ChunkTriangleCapacity;
+  Result.Batches = Cache->SlotBatches + Slot * Cache->SlotBatchCount;
+  return Result;
+}
+
+cached_geometry_chunk AcquireGeometryChunk(geometry_cache *Cache, memsize ChunkIndex) {
+  DebugAssert(ChunkIndex < Cache->Stream->ChunkCount);
+
+  memsize Entry = FindSlotEntry(Cache, ChunkIndex);
+  memsize Slot = Cache->SlotTable[Entry];
+  if(Slot != MEMSIZE_MAX) {
+    Cache->Stats.Hits++;
+    TouchSlot(Cache, Slot);
+    return GetSlotChunk(Cache, Slot);
+  }
+
+  Cache->Stats.Misses++;
+  Slot = Cache->LastUsedSlot;
+  if(Cache->SlotChunks[Slot] != MEMSIZE_MAX) {
+    RemoveSlotEntry(Cache, FindSlotEntry(Cache, Cache->SlotChunks[Slot]));
+    // The removal may have moved the free entry we found above.
+    Cache->SlotChunks[Slot] = MEMSIZE_MAX;
+    Entry = FindSlotEntry(Cache, ChunkIndex);
+  }
+
+  // The calling ray simply waits for the read to finish.
+  geometry_chunk_info const *Chunk = Cache->Stream->Chunks + ChunkIndex;
+  triangle *Triangles = Cache->SlotTriangles + Slot * Cache->Stream->ChunkTriangleCapacity;
+  memsize Size = sizeof(triangle) * Chunk->TriangleCount;
+  ssize_t ReadSize = pread(Cache->Stream->FileDescriptor, Triangles, Size, Chunk->Offset);
+  ReleaseAssert(ReadSize == static_cast<ssize_t>(Size), "Could not read geometry chunk.");
+  Cache->Stats.BytesRead += Size;
+
+  triangle_batch *Batches = Cache->SlotBatches + Slot * Cache->SlotBatchCount;
+  for(memsize I=0; I<Chunk->TriangleCount; I+=SIMD_WIDTH) {
+    triangle const *Lanes[SIMD_WIDTH];
+    for(memsize Lane=0; Lane<SIMD_WIDTH; ++Lane) {
+      Lanes[Lane] = Triangles + MinMemsize(I + Lane, Chunk->TriangleCount - 1);
+    }
+    LoadTriangleBatch(Batches + I / SIMD_WIDTH, Lanes);
+  }
+
+  Cache->SlotChunks[Slot] = ChunkIndex;
+  Cache->SlotTable[Entry] = Slot;
+  TouchSlot(Cache, Slot);
+  return GetSlotChunk(Cache, Slot);
+}
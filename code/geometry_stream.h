@@ -0,0 +1,93 @@
+#pragma once
+
+#include "lib/def.h"
+#include "lib/memory.h"
+#include "primitives.h"
+
+// Out-of-core triangle storage. The geometry file holds triangles
+// grouped into spatially coherent chunks, and the median split tree
+// that produced them. Only the tree and the chunk table stay resident.
+// Triangle data is paged into a per-worker cache of fixed size on
+// demand.
+
+#define GEOMETRY_NODE_LEAF 3
+// Median splits halve the triangle count per level, so the tree is
+// never deeper than this.
+#define GEOMETRY_TREE_MAX_DEPTH 64
+
+// Nodes are stored depth first: an interior node's first child
+// directly follows it. The first child holds the triangles with the
+// lower centroids along SplitAxis.
+struct geometry_chunk_node {
+  v3fp32 BoundsMin;
+  v3fp32 BoundsMax;
+  // Index of the second child, or of the chunk for leaves.
+  ui32 Index;
+  // 0-2, or GEOMETRY_NODE_LEAF.
+  ui32 SplitAxis;
+};
+
+struct geometry_chunk_info {
+  v3fp32 BoundsMin;
+  v3fp32 BoundsMax;
+  ui64 Offset;
+  ui64 TriangleCount;
+};
+
+struct geometry_stream {
+  int FileDescriptor;
+  memsize NodeCount;
+  geometry_chunk_node *Nodes;
+  memsize ChunkCount;
+  memsize ChunkTriangleCapacity;
+  geometry_chunk_info *Chunks;
+};
+
+struct geometry_cache_stats {
+  ui64 Hits;
+  ui64 Misses;
+  ui64 BytesRead;
+};
+
+// Least recently used cache of chunks. Not thread safe; every worker
+// owns one. Its memory, including the bookkeeping, is bounded by the
+// byte budget and independent of the stream's chunk count.
+struct geometry_cache {
+  geometry_stream const *Stream;
+  memsize SlotCount;
+  triangle *SlotTriangles;
+  // The same triangles transposed for IntersectTriangleBatch, so the
+  // transposition is paid once per read instead of once per ray.
+  triangle_batch *SlotBatches;
+  memsize SlotBatchCount;
+  memsize *SlotChunks;
+
+  // Doubly linked list of all slots, most recently used first, so
+  // finding the eviction victim does not scan the slots.
+  memsize *SlotPrevious;
+  memsize *SlotNext;
+  memsize FirstUsedSlot;
+  memsize LastUsedSlot;
+
+  // Open-addressed map from chunk index to slot, with linear probing.
+  // Holds slot indices, MEMSIZE_MAX marks a free entry.
+  memsize *SlotTable;
+  memsize SlotTableMask;
+  geometry_cache_stats Stats;
+};
+
+bool WriteGeometryFile(char const *Path, triangle const *Triangles, memsize TriangleCount, memsize ChunkTriangleCapacity);
+bool OpenGeometryStream(geometry_stream *Stream, char const *Path);
+void CloseGeometryStream(geometry_stream *Stream);
+
+// Pushes at most ByteBudget bytes into Arena.
+void InitGeometryCache(geometry_cache *Cache, geometry_stream const *Stream, memsize ByteBudget, memory_arena *Arena);
+
+// Batches hold the triangles in order. Lanes past the chunk's triangle
+// count repeat its last triangle.
+struct cached_geometry_chunk {
+  triangle const *Triangles;
+  triangle_batch const *Batches;
+};
+
+cached_geometry_chunk AcquireGeometryChunk(geometry_cache *Cache, memsize ChunkIndex);
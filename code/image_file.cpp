@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "image_file.h"
+#include "lib/assert.h"
+
+bool CreateMappedImage(mapped_image *Image, char const *Path, v2ui16 Dimension) {
+  char Header[32];
+  int HeaderSize = snprintf(Header, sizeof(Header), "P6\n%u %u\n255\n", Dimension.X, Dimension.Y);
+  memsize PixelDataSize = static_cast<memsize>(Dimension.X) * Dimension.Y * sizeof(color);
+
+  Image->FileDescriptor = open(Path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(Image->FileDescriptor == -1) {
+    return false;
+  }
+
+  Image->MappingSize = HeaderSize + PixelDataSize;
+  if(ftruncate(Image->FileDescriptor, Image->MappingSize) != 0) {
+    close(Image->FileDescriptor);
+    return false;
+  }
+
+  void *Mapping = mmap(nullptr, Image->MappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, Image->FileDescriptor, 0);
+  if(Mapping == MAP_FAILED) {
+    close(Image->FileDescriptor);
+    return false;
+  }
+
+  Image->Mapping = static_cast<ui8*>(Mapping);
+  for(int I=0; I<HeaderSize; ++I) {
+    Image->Mapping[I] = Header[I];
+  }
+  Image->Pixels = reinterpret_cast<color*>(Image->Mapping + HeaderSize);
+  Image->Dimension = Dimension;
+  return true;
+}
+
+color* GetMappedImageRow(mapped_image *Image, memsize Row) {
+  DebugAssert(Row < Image->Dimension.Y);
+  return Image->Pixels + (Image->Dimension.Y - 1 - Row) * Image->Dimension.X;
+}
+
+// Starts writeback of the given rows and drops them from our address
+// space. The file mapping is shared, so the data stays in the page
+// cache and on disk; a neighbouring tile still writing to a boundary
+// page simply faults it back in.
+void FlushMappedImageRows(mapped_image *Image, memsize FirstRow, memsize RowCount) {
+  // The rows are stored upside down, so the last one comes first.
+  memsize PageSize = sysconf(_SC_PAGESIZE);
+  ui8 *Begin = reinterpret_cast<ui8*>(GetMappedImageRow(Image, FirstRow + RowCount - 1));
+  ui8 *End = reinterpret_cast<ui8*>(GetMappedImageRow(Image, FirstRow) + Image->Dimension.X);
+
+  memsize PageBegin = reinterpret_cast<memsize>(Begin) & ~(PageSize - 1);
+  memsize Size = reinterpret_cast<memsize>(End) - PageBegin;
+  msync(reinterpret_cast<void*>(PageBegin), Size, MS_ASYNC);
+  madvise(reinterpret_cast<void*>(PageBegin), Size, MADV_DONTNEED);
+}
+
+void CloseMappedImage(mapped_image *Image) {
+  munmap(Image->Mapping, Image->MappingSize);
+  close(Image->FileDescriptor);
+  Image->Mapping = nullptr;
+  Image->Pixels = nullptr;
+}
+
+// PFM stores rows bottom to top, just like our buffers, so rows go out
+// in memory order. A negative scale marks little endian, which is what
+// every platform we build for uses.
+bool WriteFloatImage(char const *Path, v2ui16 Dimension, v3fp32 const *Pixels) {
+  FILE *File = fopen(Path, "wb");
+  if(!File) {
+    return false;
+  }
+
+  bool Result = fprintf(File, "PF\n%u %u\n-1.0\n", Dimension.X, Dimension.Y) > 0;
+  for(memsize Y=0; Result && Y<Dimension.Y; ++Y) {
+    v3fp32 const *Row = Pixels + Y * Dimension.X;
+    for(memsize X=0; Result && X<Dimension.X; ++X) {
+      fp32 RGB[3] = { Row[X].X, Row[X].Y, Row[X].Z };
+      Result = fwrite(RGB, sizeof(RGB), 1, File) == 1;
+    }
+  }
+
+  return fclose(File) == 0 && Result;
+}
+
+bool ReadFloatImage(char const *Path, v2ui16 Dimension, v3fp32 *Pixels) {
+  FILE *File = fopen(Path, "rb");
+  if(!File) {
+    return false;
+  }
+
+  unsigned Width, Height;
+  float Scale;
+  bool Result = (
+    fscanf(File, "PF %u %u %f", &Width, &Height, &Scale) == 3 &&
+    fgetc(File) == '\n' &&
+    Width == Dimension.X && Height == Dimension.Y && Scale < 0
+  );
+  for(memsize Y=0; Result && Y<Dimension.Y; ++Y) {
+    v3fp32 *Row = Pixels + Y * Dimension.X;
+    for(memsize X=0; Result && X<Dimension.X; ++X) {
+      fp32 RGB[3];
+      Result = fread(RGB, sizeof(RGB), 1, File) == 1;
+      Row[X].Set(RGB[0], RGB[1], RGB[2]);
+    }
+  }
+
+  fclose(File);
+  return Result;
+}
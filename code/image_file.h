@@ -0,0 +1,29 @@
+#pragma once
+
+#include "lib/def.h"
+#include "primitives.h"
+
+// Binary PPM file mapped into memory. Its rows have the 3-byte layout
+// of a color buffer, so tiles can be rendered straight into the file
+// and flushed as they complete. PPM stores the top row first while
+// color buffers start at the bottom, so rows are addressed through
+// GetMappedImageRow, which takes a color buffer row index.
+struct mapped_image {
+  int FileDescriptor;
+  ui8 *Mapping;
+  memsize MappingSize;
+  color *Pixels;
+  v2ui16 Dimension;
+};
+
+bool CreateMappedImage(mapped_image *Image, char const *Path, v2ui16 Dimension);
+color* GetMappedImageRow(mapped_image *Image, memsize Row);
+// Rows are color buffer rows, as for GetMappedImageRow.
+void FlushMappedImageRows(mapped_image *Image, memsize FirstRow, memsize RowCount);
+void CloseMappedImage(mapped_image *Image);
+
+// Portable float map (PFM) files hold linear RGB radiance, e.g. for
+// reference renders. Pixels are row-major, bottom row first like every
+// other buffer of the renderer.
+bool WriteFloatImage(char const *Path, v2ui16 Dimension, v3fp32 const *Pixels);
+bool ReadFloatImage(char const *Path, v2ui16 Dimension, v3fp32 *Pixels);
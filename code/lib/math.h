@@ -16,7 +16,7 @@ inline fp32 CosFP32(fp32 Angle) {
 }
 
 inline fp32 SqrtFP32(fp32 N) {
-  return sqrt(N);
+  return sqrtf(N);
 }
 
 struct v2ui16 {
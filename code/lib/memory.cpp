@@ -0,0 +1,21 @@
+#include <new>
+#include <string.h>
+#include "memory.h"
+
+void InitMemoryArena(memory_arena *Arena, memsize Capacity) {
+  Arena->Base = new (std::nothrow) ui8[Capacity];
+  ReleaseAssert(Arena->Base != nullptr, "Could not allocate memory arena.");
+  Arena->Capacity = Capacity;
+  Arena->Used = 0;
+
+  // Touch every page from the calling thread, so first-touch placement
+  // puts the arena on the memory node of the thread that will use it.
+  memset(Arena->Base, 0, Capacity);
+}
+
+void TerminateMemoryArena(memory_arena *Arena) {
+  delete[] Arena->Base;
+  Arena->Base = nullptr;
+  Arena->Capacity = 0;
+  Arena->Used = 0;
+}
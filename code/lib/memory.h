@@ -0,0 +1,42 @@
+#pragma once
+
+#include "lib/def.h"
+#include "lib/assert.h"
+
+struct memory_arena {
+  ui8 *Base;
+  memsize Capacity;
+  memsize Used;
+};
+
+struct temp_memory {
+  memory_arena *Arena;
+  memsize Used;
+};
+
+void InitMemoryArena(memory_arena *Arena, memsize Capacity);
+void TerminateMemoryArena(memory_arena *Arena);
+
+inline void* MemoryArenaPush(memory_arena *Arena, memsize Size, memsize Alignment) {
+  memsize Address = reinterpret_cast<memsize>(Arena->Base) + Arena->Used;
+  memsize Padding = (Alignment - (Address & (Alignment - 1))) & (Alignment - 1);
+  ReleaseAssert(Arena->Used + Padding + Size <= Arena->Capacity, "Memory arena exhausted.");
+  void *Result = Arena->Base + Arena->Used + Padding;
+  Arena->Used += Padding + Size;
+  return Result;
+}
+
+#define MemoryArenaPushStruct(Arena, Type) static_cast<Type*>(MemoryArenaPush(Arena, sizeof(Type), alignof(Type)))
+#define MemoryArenaPushArray(Arena, Type, Count) static_cast<Type*>(MemoryArenaPush(Arena, sizeof(Type)*(Count), alignof(Type)))
+
+inline temp_memory BeginTempMemory(memory_arena *Arena) {
+  temp_memory Result;
+  Result.Arena = Arena;
+  Result.Used = Arena->Used;
+  return Result;
+}
+
+inline void EndTempMemory(temp_memory Temp) {
+  DebugAssert(Temp.Arena->Used >= Temp.Used);
+  Temp.Arena->Used = Temp.Used;
+}
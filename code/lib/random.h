@@ -0,0 +1,37 @@
+#pragma once
+
+#include "lib/def.h"
+
+// PCG32 random number generator. Series are cheap to seed, so every
+// pixel of every sample can start its own one. The random numbers of
+// a pixel then only depend on where it is and which sample it is, not
+// on which thread renders it or in which order.
+struct random_series {
+  ui64 State;
+};
+
+inline random_series SeedRandomSeries(ui64 Sequence, ui64 Index) {
+  // SplitMix64 finalizer, so neighbouring indices get unrelated states.
+  ui64 Z = (Sequence << 32) ^ Index;
+  Z += 0x9E3779B97F4A7C15ULL;
+  Z = (Z ^ (Z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  Z = (Z ^ (Z >> 27)) * 0x94D049BB133111EBULL;
+  Z ^= Z >> 31;
+
+  random_series Series;
+  Series.State = Z;
+  return Series;
+}
+
+inline ui32 RandomNextUI32(random_series *Series) {
+  ui64 OldState = Series->State;
+  Series->State = OldState * 6364136223846793005ULL + 1442695040888963407ULL;
+  ui32 XorShifted = static_cast<ui32>(((OldState >> 18) ^ OldState) >> 27);
+  ui32 Rotation = static_cast<ui32>(OldState >> 59);
+  return (XorShifted >> Rotation) | (XorShifted << ((32 - Rotation) & 31));
+}
+
+// Uniform in [0, 1).
+inline fp32 RandomUnilateral(random_series *Series) {
+  return (RandomNextUI32(Series) >> 8) * (1.0f / 16777216.0f);
+}
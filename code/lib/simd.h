@@ -0,0 +1,416 @@
+#pragma once
+
+#include "lib/math.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SIMD_NEON 1
+#else
+#define SIMD_SCALAR 1
+#endif
+
+#define SIMD_WIDTH 4
+
+// Four fp32 lanes. Lane masks (all bits set or cleared) are stored in
+// the same type, so they can be fed to SelectFP32x4().
+struct fp32x4 {
+#if SIMD_SSE2
+  __m128 V;
+#elif SIMD_NEON
+  float32x4_t V;
+#else
+  fp32 V[4];
+#endif
+};
+
+// Four si32 lanes, used for range reduction and bit manipulation.
+struct si32x4 {
+#if SIMD_SSE2
+  __m128i V;
+#elif SIMD_NEON
+  int32x4_t V;
+#else
+  si32 V[4];
+#endif
+};
+
+#if SIMD_SCALAR
+#define SIMD_LANES(Result, Expression) \
+  for(memsize Lane=0; Lane<4; ++Lane) { Result.V[Lane] = (Expression); }
+
+inline ui32 FP32Bits(fp32 F) {
+  union { fp32 F; ui32 U; } Cast;
+  Cast.F = F;
+  return Cast.U;
+}
+
+inline fp32 BitsFP32(ui32 U) {
+  union { fp32 F; ui32 U; } Cast;
+  Cast.U = U;
+  return Cast.F;
+}
+#endif
+
+inline fp32x4 SetFP32x4(fp32 R) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_set1_ps(R);
+#elif SIMD_NEON
+  Result.V = vdupq_n_f32(R);
+#else
+  SIMD_LANES(Result, R);
+#endif
+  return Result;
+}
+
+inline fp32x4 LoadFP32x4(fp32 const *Source) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_loadu_ps(Source);
+#elif SIMD_NEON
+  Result.V = vld1q_f32(Source);
+#else
+  SIMD_LANES(Result, Source[Lane]);
+#endif
+  return Result;
+}
+
+inline void StoreFP32x4(fp32 *Destination, fp32x4 A) {
+#if SIMD_SSE2
+  _mm_storeu_ps(Destination, A.V);
+#elif SIMD_NEON
+  vst1q_f32(Destination, A.V);
+#else
+  for(memsize Lane=0; Lane<4; ++Lane) {
+    Destination[Lane] = A.V[Lane];
+  }
+#endif
+}
+
+inline fp32x4 operator+(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_add_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vaddq_f32(A.V, B.V);
+#else
+  SIMD_LANES(Result, A.V[Lane] + B.V[Lane]);
+#endif
+  return Result;
+}
+
+inline fp32x4 operator-(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_sub_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vsubq_f32(A.V, B.V);
+#else
+  SIMD_LANES(Result, A.V[Lane] - B.V[Lane]);
+#endif
+  return Result;
+}
+
+inline fp32x4 operator*(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_mul_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vmulq_f32(A.V, B.V);
+#else
+  SIMD_LANES(Result, A.V[Lane] * B.V[Lane]);
+#endif
+  return Result;
+}
+
+inline fp32x4 operator/(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_div_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vdivq_f32(A.V, B.V);
+#else
+  SIMD_LANES(Result, A.V[Lane] / B.V[Lane]);
+#endif
+  return Result;
+}
+
+inline fp32x4 operator*(fp32x4 A, fp32 S) {
+  return A * SetFP32x4(S);
+}
+
+inline fp32x4 SqrtFP32x4(fp32x4 A) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_sqrt_ps(A.V);
+#elif SIMD_NEON
+  Result.V = vsqrtq_f32(A.V);
+#else
+  SIMD_LANES(Result, SqrtFP32(A.V[Lane]));
+#endif
+  return Result;
+}
+
+// Lane mask that is set where A > B.
+inline fp32x4 GreaterFP32x4(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_cmpgt_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vreinterpretq_f32_u32(vcgtq_f32(A.V, B.V));
+#else
+  SIMD_LANES(Result, BitsFP32(A.V[Lane] > B.V[Lane] ? 0xFFFFFFFF : 0));
+#endif
+  return Result;
+}
+
+// Lane mask that is set where A < B.
+inline fp32x4 LessFP32x4(fp32x4 A, fp32x4 B) {
+  return GreaterFP32x4(B, A);
+}
+
+inline fp32x4 OrFP32x4(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_or_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(A.V), vreinterpretq_u32_f32(B.V)));
+#else
+  SIMD_LANES(Result, BitsFP32(FP32Bits(A.V[Lane]) | FP32Bits(B.V[Lane])));
+#endif
+  return Result;
+}
+
+// Packs the top bit of each lane into bit Lane of the result.
+inline ui32 MaskBitsFP32x4(fp32x4 Mask) {
+#if SIMD_SSE2
+  return static_cast<ui32>(_mm_movemask_ps(Mask.V));
+#elif SIMD_NEON
+  static const ui32 LaneBits[4] = { 1, 2, 4, 8 };
+  uint32x4_t Top = vshrq_n_u32(vreinterpretq_u32_f32(Mask.V), 31);
+  return vaddvq_u32(vmulq_u32(Top, vld1q_u32(LaneBits)));
+#else
+  ui32 Result = 0;
+  for(memsize Lane=0; Lane<4; ++Lane) {
+    Result |= (FP32Bits(Mask.V[Lane]) >> 31) << Lane;
+  }
+  return Result;
+#endif
+}
+
+inline fp32x4 AndFP32x4(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_and_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(A.V), vreinterpretq_u32_f32(B.V)));
+#else
+  SIMD_LANES(Result, BitsFP32(FP32Bits(A.V[Lane]) & FP32Bits(B.V[Lane])));
+#endif
+  return Result;
+}
+
+inline fp32x4 XorFP32x4(fp32x4 A, fp32x4 B) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_xor_ps(A.V, B.V);
+#elif SIMD_NEON
+  Result.V = vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(A.V), vreinterpretq_u32_f32(B.V)));
+#else
+  SIMD_LANES(Result, BitsFP32(FP32Bits(A.V[Lane]) ^ FP32Bits(B.V[Lane])));
+#endif
+  return Result;
+}
+
+// Picks B where Mask is set and A elsewhere.
+inline fp32x4 SelectFP32x4(fp32x4 A, fp32x4 B, fp32x4 Mask) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_or_ps(_mm_andnot_ps(Mask.V, A.V), _mm_and_ps(Mask.V, B.V));
+#elif SIMD_NEON
+  Result.V = vbslq_f32(vreinterpretq_u32_f32(Mask.V), B.V, A.V);
+#else
+  SIMD_LANES(Result, BitsFP32((FP32Bits(A.V[Lane]) & ~FP32Bits(Mask.V[Lane])) | (FP32Bits(B.V[Lane]) & FP32Bits(Mask.V[Lane]))));
+#endif
+  return Result;
+}
+
+inline fp32x4 AbsFP32x4(fp32x4 A) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_andnot_ps(_mm_set1_ps(-0.0f), A.V);
+#elif SIMD_NEON
+  Result.V = vabsq_f32(A.V);
+#else
+  SIMD_LANES(Result, fabsf(A.V[Lane]));
+#endif
+  return Result;
+}
+
+inline si32x4 TruncateFP32x4(fp32x4 A) {
+  si32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_cvttps_epi32(A.V);
+#elif SIMD_NEON
+  Result.V = vcvtq_s32_f32(A.V);
+#else
+  SIMD_LANES(Result, static_cast<si32>(A.V[Lane]));
+#endif
+  return Result;
+}
+
+inline fp32x4 ConvertSI32x4(si32x4 A) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_cvtepi32_ps(A.V);
+#elif SIMD_NEON
+  Result.V = vcvtq_f32_s32(A.V);
+#else
+  SIMD_LANES(Result, static_cast<fp32>(A.V[Lane]));
+#endif
+  return Result;
+}
+
+inline si32x4 AddSI32x4(si32x4 A, si32 B) {
+  si32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_add_epi32(A.V, _mm_set1_epi32(B));
+#elif SIMD_NEON
+  Result.V = vaddq_s32(A.V, vdupq_n_s32(B));
+#else
+  SIMD_LANES(Result, A.V[Lane] + B);
+#endif
+  return Result;
+}
+
+inline si32x4 AndSI32x4(si32x4 A, si32 B) {
+  si32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_and_si128(A.V, _mm_set1_epi32(B));
+#elif SIMD_NEON
+  Result.V = vandq_s32(A.V, vdupq_n_s32(B));
+#else
+  SIMD_LANES(Result, A.V[Lane] & B);
+#endif
+  return Result;
+}
+
+// Moves bit 2 of each lane into the fp32 sign bit.
+inline fp32x4 Bit2ToSignFP32x4(si32x4 A) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  Result.V = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(A.V, _mm_set1_epi32(4)), 29));
+#elif SIMD_NEON
+  Result.V = vreinterpretq_f32_s32(vshlq_n_s32(vandq_s32(A.V, vdupq_n_s32(4)), 29));
+#else
+  SIMD_LANES(Result, BitsFP32(static_cast<ui32>(A.V[Lane] & 4) << 29));
+#endif
+  return Result;
+}
+
+// Lane mask that is set where bit 1 of A is clear.
+inline fp32x4 Bit1ClearMaskFP32x4(si32x4 A) {
+  fp32x4 Result;
+#if SIMD_SSE2
+  __m128i Bit = _mm_and_si128(A.V, _mm_set1_epi32(2));
+  Result.V = _mm_castsi128_ps(_mm_cmpeq_epi32(Bit, _mm_setzero_si128()));
+#elif SIMD_NEON
+  uint32x4_t Bit = vandq_u32(vreinterpretq_u32_s32(A.V), vdupq_n_u32(2));
+  Result.V = vreinterpretq_f32_u32(vceqq_u32(Bit, vdupq_n_u32(0)));
+#else
+  SIMD_LANES(Result, BitsFP32((A.V[Lane] & 2) ? 0 : 0xFFFFFFFF));
+#endif
+  return Result;
+}
+
+// Computes sine and cosine of four angles at once, sharing the range
+// reduction. Uses the Cephes single precision minimax polynomials, so
+// the result stays within a few ULP of sinf/cosf for |Angle| < 8192.
+inline void SinCosFP32x4(fp32x4 Angle, fp32x4 *Sin, fp32x4 *Cos) {
+  fp32x4 SignMask = SetFP32x4(-0.0f);
+  fp32x4 SinSign = AndFP32x4(Angle, SignMask);
+  fp32x4 X = AbsFP32x4(Angle);
+
+  si32x4 Octant = TruncateFP32x4(X * static_cast<fp32>(4.0 / M_PI));
+  Octant = AndSI32x4(AddSI32x4(Octant, 1), ~1);
+  fp32x4 Y = ConvertSI32x4(Octant);
+
+  SinSign = XorFP32x4(SinSign, Bit2ToSignFP32x4(Octant));
+  fp32x4 CosSign = XorFP32x4(Bit2ToSignFP32x4(AddSI32x4(Octant, -2)), SignMask);
+  fp32x4 PolyMask = Bit1ClearMaskFP32x4(Octant);
+
+  X = X - Y * 0.78515625f;
+  X = X - Y * 2.4187564849853515625e-4f;
+  X = X - Y * 3.77489497744594108e-8f;
+  fp32x4 Z = X * X;
+
+  fp32x4 CosPoly = Z * 2.443315711809948e-5f + SetFP32x4(-1.388731625493765e-3f);
+  CosPoly = CosPoly * Z + SetFP32x4(4.166664568298827e-2f);
+  CosPoly = CosPoly * Z * Z - Z * 0.5f + SetFP32x4(1.0f);
+
+  fp32x4 SinPoly = Z * -1.9515295891e-4f + SetFP32x4(8.3321608736e-3f);
+  SinPoly = SinPoly * Z + SetFP32x4(-1.6666654611e-1f);
+  SinPoly = SinPoly * Z * X + X;
+
+  *Sin = XorFP32x4(SelectFP32x4(CosPoly, SinPoly, PolyMask), SinSign);
+  *Cos = XorFP32x4(SelectFP32x4(SinPoly, CosPoly, PolyMask), CosSign);
+}
+
+// Four 3D vectors in structure-of-arrays layout.
+struct v3fp32x4 {
+  fp32x4 X;
+  fp32x4 Y;
+  fp32x4 Z;
+};
+
+inline v3fp32x4 operator-(v3fp32x4 const &A, v3fp32x4 const &B) {
+  v3fp32x4 Result;
+  Result.X = A.X - B.X;
+  Result.Y = A.Y - B.Y;
+  Result.Z = A.Z - B.Z;
+  return Result;
+}
+
+// Same operation order as v3fp32::Dot and v3fp32::Cross, so each lane
+// rounds exactly like the scalar version.
+inline fp32x4 DotV3FP32x4(v3fp32x4 const &A, v3fp32x4 const &B) {
+  return A.X * B.X + A.Y * B.Y + A.Z * B.Z;
+}
+
+inline v3fp32x4 CrossV3FP32x4(v3fp32x4 const &A, v3fp32x4 const &B) {
+  v3fp32x4 Result;
+  Result.X = A.Y * B.Z - A.Z * B.Y;
+  Result.Y = A.Z * B.X - A.X * B.Z;
+  Result.Z = A.X * B.Y - A.Y * B.X;
+  return Result;
+}
+
+inline v3fp32x4 SetV3FP32x4(v3fp32 V) {
+  v3fp32x4 Result;
+  Result.X = SetFP32x4(V.X);
+  Result.Y = SetFP32x4(V.Y);
+  Result.Z = SetFP32x4(V.Z);
+  return Result;
+}
+
+inline v3fp32x4 operator*(m33fp32 const &M, v3fp32x4 const &V) {
+  v3fp32x4 Result;
+  Result.X = V.X * M.Col1.X + V.Y * M.Col2.X + V.Z * M.Col3.X;
+  Result.Y = V.X * M.Col1.Y + V.Y * M.Col2.Y + V.Z * M.Col3.Y;
+  Result.Z = V.X * M.Col1.Z + V.Y * M.Col2.Z + V.Z * M.Col3.Z;
+  return Result;
+}
+
+// Writes lane I of V to Destination[I] (array-of-structures layout).
+inline void StoreV3FP32x4(v3fp32 *Destination, v3fp32x4 const &V) {
+  fp32 X[4], Y[4], Z[4];
+  StoreFP32x4(X, V.X);
+  StoreFP32x4(Y, V.Y);
+  StoreFP32x4(Z, V.Z);
+  for(memsize Lane=0; Lane<4; ++Lane) {
+    Destination[Lane].Set(X[Lane], Y[Lane], Z[Lane]);
+  }
+}
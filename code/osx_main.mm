@@ -2,15 +2,32 @@
 #include <AppKit/AppKit.h>
 #include <OpenGL/gl.h>
 #include <new>
-#include <thread>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include "lib/math.h"
 #include "lib/assert.h"
 #include "rendering.h"
+#include "worker_pool.h"
+#include "benchmark.h"
+#include "checkpoint.h"
 #include "game.h"
 
 #define THREAD_COUNT 4
+#define PIN_THREADS 0
+#define WORKER_ARENA_SIZE (1024*1024)
+// Frames in flight: one being presented while the next is traced.
+#define FRAME_BUFFER_COUNT 2
+// Microseconds between checkpoints of progressive renders.
+#define CHECKPOINT_INTERVAL (60*1000*1000)
+
+// Traces triangles from an on-disk geometry file through a bounded
+// cache instead of keeping them resident.
+#define OUT_OF_CORE_GEOMETRY 0
+#define GEOMETRY_FILE_PATH "/tmp/pathtracer_geometry.bin"
+#define GEOMETRY_CHUNK_TRIANGLE_COUNT 8
+#define GEOMETRY_CACHE_SIZE (64*1024)
 
 #define ArrayCount(Array) (sizeof(Array) / sizeof((Array)[0]))
 
@@ -19,11 +36,19 @@
 #define OSX_KEYCODE_D 0x02
 #define OSX_KEYCODE_W 0x0D
 
-enum struct worker_state {
-  uninitialized,
-  work_scheduled,
-  work_completed,
-  shutdown
+// Input-to-photon latency: from the moment a key event is processed
+// until the first frame that reflects it has been handed to the
+// display.
+struct input_latency_stats {
+  ui64 SampleCount;
+  uusec64 TotalLatency;
+  uusec64 MaxLatency;
+  ui64 CancelledFrameCount;
+};
+
+struct pipeline_frame_timing {
+  uusec64 StartTime;
+  uusec64 InputTime;
 };
 
 struct osx_state {
@@ -36,13 +61,18 @@ struct osx_state {
   resolution RenderResolution;
   scene Scene;
   game_input GameInput = {};
-  memsize TileCount;
   uusec64 LastFrameTime;
-  std::thread Threads[THREAD_COUNT];
-  std::atomic<memsize> CurrentTileIndex;
-  worker_state WorkerState;
-  std::mutex WorkerMutex;
-  std::condition_variable SyncEvent;
+  worker_pool WorkerPool;
+  geometry_stream GeometryStream;
+
+  frame_pipeline Pipeline;
+  // Indexed like the pipeline slots. InputTime is the oldest input
+  // event the frame reflects, zero if none.
+  pipeline_frame_timing FrameTimings[FRAME_BUFFER_COUNT];
+  // Time of the oldest input event not yet reflected in a submitted
+  // frame. Zero means none.
+  uusec64 PendingInputTime;
+  input_latency_stats InputLatency;
 };
 
 @interface PathtracerAppDelegate : NSObject <NSApplicationDelegate>
@@ -132,8 +162,12 @@ static NSWindow* CreateOSXWindow(v2ui16 Resolution) {
 static void UpdateGameButton(game_button *Button, NSEventType Type) {
   switch(Type) {
     case NSKeyDown:
-      Button->ChangeCount++;
-      Button->Pressed = true;
+      // Ignore auto-repeat, so holding a key does not keep cancelling
+      // frames.
+      if(!Button->Pressed) {
+        Button->ChangeCount++;
+        Button->Pressed = true;
+      }
       break;
     case NSKeyUp:
       Button->ChangeCount++;
@@ -242,77 +276,337 @@ static void TerminateFrameBuffer(osx_state *State) {
   State->RenderBuffer = nullptr;
 }
 
-static void WorkerMain(osx_state *State) {
-  for(;;) {
-    std::unique_lock<std::mutex> Lock(State->WorkerMutex);
-    switch(State->WorkerState) {
-      case worker_state::work_scheduled: {
-        Lock.unlock();
-        for(;;) {
-          memsize TileIndex = State->CurrentTileIndex.fetch_add(1, std::memory_order_relaxed);
-          if(TileIndex < State->TileCount) {
-            RenderTile(State->RenderBuffer, &State->Scene, TileIndex);
-            if(TileIndex + 1 == State->TileCount) {
-              Lock.lock();
-              State->WorkerState = worker_state::work_completed;
-              Lock.unlock();
-              State->SyncEvent.notify_all();
-            }
-          }
-          else {
-            break;
-          }
-        }
-        break;
-      }
-      case worker_state::shutdown:
-        return;
-        break;
-      default:
-        State->SyncEvent.wait(Lock);
-    }
-  }
+static worker_pool_options GetWorkerPoolOptions(memsize ArenaSize) {
+  worker_pool_options Options;
+  Options.ArenaSize = ArenaSize;
+  Options.PinThreads = PIN_THREADS;
+  return Options;
 }
 
 static void CreateThreads(osx_state *State) {
-  for(memsize I=0; I<THREAD_COUNT; ++I) {
-    State->Threads[I] = std::thread(WorkerMain, State);
-  }
+  worker_pool_options Options = GetWorkerPoolOptions(WORKER_ARENA_SIZE + GEOMETRY_CACHE_SIZE / THREAD_COUNT);
+  CreateWorkerPool(&State->WorkerPool, THREAD_COUNT, Options);
+}
+
+// The headless modes never stream geometry, so their workers only
+// need the base arena.
+static void CreateHeadlessWorkerPool(worker_pool *Pool) {
+  CreateWorkerPool(Pool, THREAD_COUNT, GetWorkerPoolOptions(WORKER_ARENA_SIZE));
 }
 
 static void DestroyThreads(osx_state *State) {
-  State->SyncEvent.notify_all();
-  for(memsize I=0; I<THREAD_COUNT; ++I) {
-    State->Threads[I].join();
-  }
+  DestroyWorkerPool(&State->WorkerPool);
 }
 
+#if OUT_OF_CORE_GEOMETRY
+// Stands in for an asset pipeline: writes the game's triangles to a
+// chunked geometry file and renders them back from disk.
+static void StreamSceneGeometry(osx_state *State) {
+  scene *Scene = &State->Scene;
+  bool Written = WriteGeometryFile(GEOMETRY_FILE_PATH, Scene->Triangles, Scene->TriangleCount, GEOMETRY_CHUNK_TRIANGLE_COUNT);
+  ReleaseAssert(Written, "Could not write geometry file.");
+  bool Opened = OpenGeometryStream(&State->GeometryStream, GEOMETRY_FILE_PATH);
+  ReleaseAssert(Opened, "Could not open geometry file.");
+
+  Scene->TriangleCount = 0;
+  Scene->AttachGeometryStream(&State->GeometryStream, GEOMETRY_CACHE_SIZE);
+}
+
+static void ReportGeometryStreamStats(worker_pool const *Pool) {
+  geometry_cache_stats Stats = CollectGeometryCacheStats(Pool);
+  ui64 Lookups = Stats.Hits + Stats.Misses;
+  printf(
+    "Geometry cache: %llu lookups, %.2f%% hits, %llu KB read\n",
+    Lookups,
+    Lookups ? 100.0 * Stats.Hits / Lookups : 0.0,
+    Stats.BytesRead / 1024
+  );
+}
+#endif
+
 static void ResetGameInputChangeCount(game_input *Input) {
   for(memsize I = 0; I < ArrayCount(Input->States); ++I) {
     Input->States[I].ChangeCount = 0;
   }
 }
 
-static void Render(osx_state *State) {
-  {
-    std::lock_guard<std::mutex> Lock(State->WorkerMutex);
-    State->CurrentTileIndex.store(0, std::memory_order_relaxed);
-    State->WorkerState = worker_state::work_scheduled;
+static bool HasNewGameInput(game_input const *Input) {
+  for(memsize I = 0; I < ArrayCount(Input->States); ++I) {
+    if(Input->States[I].ChangeCount != 0) {
+      return true;
+    }
   }
-  State->SyncEvent.notify_all();
+  return false;
+}
 
-  for(;;) {
-    std::unique_lock<std::mutex> Lock(State->WorkerMutex);
-    if(State->WorkerState == worker_state::work_completed) {
-      break;
+static void SubmitRender(osx_state *State) {
+  pipeline_frame_timing *Timing = State->FrameTimings + State->Pipeline.SubmittedCount % FRAME_BUFFER_COUNT;
+  SubmitPipelineFrame(&State->Pipeline, &State->Scene);
+  Timing->StartTime = GetTime();
+  Timing->InputTime = State->PendingInputTime;
+  State->PendingInputTime = 0;
+}
+
+// Stale frames are dropped at tile granularity: workers finish the
+// tiles they are on and skip the rest. The newest frame in flight is
+// kept, so something reaches the screen even under constant input.
+static void CancelRenders(osx_state *State) {
+  frame_pipeline *Pipeline = &State->Pipeline;
+  if(Pipeline->SubmittedCount == Pipeline->ReleasedCount) {
+    return;
+  }
+  State->InputLatency.CancelledFrameCount += CancelStalePipelineFrames(Pipeline);
+
+  // The newest frame already includes the input of the dropped ones,
+  // so their photons arrive with it. Timings share the frame's slot.
+  pipeline_frame_timing *Newest = State->FrameTimings + (Pipeline->SubmittedCount - 1) % FRAME_BUFFER_COUNT;
+  for(memsize I=0; I<FRAME_BUFFER_COUNT; ++I) {
+    pipeline_frame_timing *Timing = State->FrameTimings + I;
+    if(Timing == Newest || Timing->InputTime == 0 || !Pipeline->Frames[I].Cancelled) {
+      continue;
     }
-    else {
-      State->SyncEvent.wait(Lock);
+    if(Newest->InputTime == 0 || Timing->InputTime < Newest->InputTime) {
+      Newest->InputTime = Timing->InputTime;
+    }
+    Timing->InputTime = 0;
+  }
+}
+
+static void PresentRender(osx_state *State, pipeline_frame *Frame) {
+  pipeline_frame_timing *Timing = State->FrameTimings + Frame->Sequence % FRAME_BUFFER_COUNT;
+  // Release the slot before the upload, so the workers can fill it
+  // with the next frame while this one is presented.
+  ResolvePipelineFrame(Frame, State->RenderBuffer);
+  ReleasePipelineFrame(&State->Pipeline, Frame);
+
+  glTexImage2D(
+    GL_TEXTURE_2D,
+    0,
+    GL_RGB,
+    State->RenderResolution.Dimension.X,
+    State->RenderResolution.Dimension.Y,
+    0,
+    GL_RGB,
+    GL_UNSIGNED_BYTE,
+    State->RenderBuffer
+  );
+
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0f, 0.0f);
+  glVertex2f(-1.0f, -1.0f);
+  glTexCoord2f(1.0f, 0.0f);
+  glVertex2f(1.0f, -1.0f);
+  glTexCoord2f(1.0f, 1.0f);
+  glVertex2f(1.0f, 1.0f);
+  glTexCoord2f(0.0f, 1.0f);
+  glVertex2f(-1.0f, 1.0f);
+  glEnd();
+
+  [State->OGLContext flushBuffer];
+
+  uusec64 PresentTime = GetTime();
+  #if BENCHMARK
+  printf("Render time: %llu ms\n", (PresentTime-Timing->StartTime)/1000);
+  #endif
+  if(Timing->InputTime != 0) {
+    uusec64 Latency = PresentTime - Timing->InputTime;
+    input_latency_stats *Stats = &State->InputLatency;
+    Stats->SampleCount++;
+    Stats->TotalLatency += Latency;
+    if(Latency > Stats->MaxLatency) {
+      Stats->MaxLatency = Latency;
+    }
+    Timing->InputTime = 0;
+  }
+}
+
+static void ReportInputLatency(input_latency_stats const *Stats) {
+  if(Stats->SampleCount == 0) {
+    return;
+  }
+  printf(
+    "Input to photon latency: mean %llu ms, max %llu ms over %llu inputs, %llu frames cancelled\n",
+    Stats->TotalLatency / Stats->SampleCount / 1000,
+    Stats->MaxLatency / 1000,
+    Stats->SampleCount,
+    Stats->CancelledFrameCount
+  );
+}
+
+// Headless mode for large stills: tiles go straight into a memory
+// mapped PPM file, so no image-sized buffer is ever allocated and
+// finished bands are visible on disk while the render runs.
+static void RenderStill(char const *Path, v2ui16 Dimension) {
+  scene Scene;
+  InitGame(&Scene);
+
+  resolution Resolution;
+  Resolution.Dimension = Dimension;
+  InitRendering(Resolution);
+
+  worker_pool Pool;
+  CreateHeadlessWorkerPool(&Pool);
+
+  mapped_image Image;
+  bool Created = CreateMappedImage(&Image, Path, Dimension);
+  ReleaseAssert(Created, "Could not create output image.");
+
+  uusec64 StartTime = GetTime();
+  RenderFrameToImage(&Pool, &Image, &Scene);
+  printf("Rendered %ux%u to %s in %llu ms\n", Dimension.X, Dimension.Y, Path, (GetTime()-StartTime)/1000);
+
+  CloseMappedImage(&Image);
+  DestroyWorkerPool(&Pool);
+  TerminateRendering();
+}
+
+// Headless progressive render. Accumulates SampleCount samples per
+// pixel and checkpoints every CHECKPOINT_INTERVAL, so a preempted job
+// can continue with -resume instead of starting over.
+static void RenderProgressive(char const *Path, v2ui16 Dimension, memsize SampleCount, char const *CheckpointPath, bool Resume) {
+  scene Scene;
+  InitGame(&Scene);
+
+  resolution Resolution;
+  Resolution.Dimension = Dimension;
+  InitRendering(Resolution);
+
+  worker_pool Pool;
+  CreateHeadlessWorkerPool(&Pool);
+
+  accumulation_buffer Accumulation;
+  InitAccumulationBuffer(&Accumulation, Resolution);
+
+  render_checkpoint Checkpoint;
+  if(Resume) {
+    bool Opened = OpenRenderCheckpoint(&Checkpoint, CheckpointPath, Resolution);
+    ReleaseAssert(Opened, "Could not open checkpoint for this resolution.");
+    if(RestoreRenderCheckpoint(&Checkpoint, &Accumulation)) {
+      printf("Resuming at sample %zu\n", Accumulation.SampleCount);
+    }
+  }
+  else {
+    bool Created = CreateRenderCheckpoint(&Checkpoint, CheckpointPath, Resolution);
+    ReleaseAssert(Created, "Could not create checkpoint.");
+  }
+
+  uusec64 StartTime = GetTime();
+  uusec64 LastCheckpointTime = StartTime;
+  while(Accumulation.SampleCount < SampleCount) {
+    // Checkpoints are filled by the workers during a pass, so the last
+    // pass is the one that must take the final one.
+    uusec64 Time = GetTime();
+    bool LastPass = Accumulation.SampleCount + 1 == SampleCount;
+    v3fp32 *Snapshot = nullptr;
+    if(LastPass || Time - LastCheckpointTime >= CHECKPOINT_INTERVAL) {
+      Snapshot = BeginRenderCheckpoint(&Checkpoint);
+      LastCheckpointTime = Time;
+    }
+    AccumulateFrame(&Pool, &Accumulation, &Scene, Snapshot);
+    if(Snapshot) {
+      CommitRenderCheckpoint(&Checkpoint, Accumulation.SampleCount);
     }
   }
+  printf("Rendered %zu samples per pixel in %llu ms\n", Accumulation.SampleCount, (GetTime()-StartTime)/1000);
+
+  mapped_image Image;
+  bool Created = CreateMappedImage(&Image, Path, Dimension);
+  ReleaseAssert(Created, "Could not create output image.");
+  ResolveAccumulationBuffer(&Accumulation, &Image);
+  CloseMappedImage(&Image);
+
+  CloseRenderCheckpoint(&Checkpoint);
+  TerminateAccumulationBuffer(&Accumulation);
+  DestroyWorkerPool(&Pool);
+  TerminateRendering();
+}
+
+static void RunBenchmark(char const *ReferencePath) {
+  scene Scene;
+  InitGame(&Scene);
+
+  resolution Resolution;
+  Resolution.Dimension.Set(160, 120);
+  InitRendering(Resolution);
+
+  worker_pool Pool;
+  CreateHeadlessWorkerPool(&Pool);
+
+  RunConvergenceBenchmark(&Pool, &Scene, Resolution, ReferencePath);
+
+  DestroyWorkerPool(&Pool);
+  TerminateRendering();
 }
 
-int main() {
+static bool RunPoolCheck() {
+  scene Scene;
+  InitGame(&Scene);
+
+  bool Passed = RunWorkerPoolCheck(&Scene, THREAD_COUNT, GetWorkerPoolOptions(WORKER_ARENA_SIZE));
+
+  TerminateRendering();
+  return Passed;
+}
+
+static void RunRayBenchmark(memsize QueryCount) {
+  scene Scene;
+  InitGame(&Scene);
+
+  worker_pool Pool;
+  CreateHeadlessWorkerPool(&Pool);
+
+  RunRayQueryBenchmark(&Pool, &Scene, QueryCount);
+
+  DestroyWorkerPool(&Pool);
+  TerminateRendering();
+}
+
+int main(int argc, char **argv) {
+  if(argc == 3 && strcmp(argv[1], "-convergence") == 0) {
+    RunBenchmark(argv[2]);
+    return 0;
+  }
+
+  if(argc == 3 && strcmp(argv[1], "-raycast") == 0) {
+    memsize QueryCount = strtoul(argv[2], nullptr, 10);
+    ReleaseAssert(QueryCount != 0, "Usage: -raycast <ray count>");
+    RunRayBenchmark(QueryCount);
+    return 0;
+  }
+
+  if(argc == 2 && strcmp(argv[1], "-poolcheck") == 0) {
+    return RunPoolCheck() ? 0 : 1;
+  }
+
+  if(argc == 2 && strcmp(argv[1], "-simdcheck") == 0) {
+    return RunSIMDAccuracyCheck() ? 0 : 1;
+  }
+
+  if(argc == 4 && strcmp(argv[1], "-still") == 0) {
+    unsigned Width, Height;
+    bool Parsed = sscanf(argv[3], "%ux%u", &Width, &Height) == 2;
+    ReleaseAssert(Parsed && Width != 0 && Height != 0 && Width <= UI16_MAX && Height <= UI16_MAX, "Usage: -still <path.ppm> <width>x<height>");
+    v2ui16 Dimension;
+    Dimension.Set(Width, Height);
+    RenderStill(argv[2], Dimension);
+    return 0;
+  }
+
+  if((argc == 6 || argc == 7) && strcmp(argv[1], "-progressive") == 0) {
+    unsigned Width, Height;
+    bool Parsed = sscanf(argv[3], "%ux%u", &Width, &Height) == 2;
+    memsize SampleCount = strtoul(argv[4], nullptr, 10);
+    bool Resume = argc == 7 && strcmp(argv[6], "-resume") == 0;
+    ReleaseAssert(
+      Parsed && Width != 0 && Height != 0 && Width <= UI16_MAX && Height <= UI16_MAX && SampleCount != 0 && (argc == 6 || Resume),
+      "Usage: -progressive <path.ppm> <width>x<height> <samples> <checkpoint> [-resume]"
+    );
+    v2ui16 Dimension;
+    Dimension.Set(Width, Height);
+    RenderProgressive(argv[2], Dimension, SampleCount, argv[5], Resume);
+    return 0;
+  }
+
   osx_state State;
   State.Running = true;
   State.Window = nullptr;
@@ -322,7 +616,15 @@ int main() {
   InitPixelBuffer(&State);
 
   InitGame(&State.Scene);
+#if OUT_OF_CORE_GEOMETRY
+  StreamSceneGeometry(&State);
+#endif
   State.LastFrameTime = GetTime();
+  for(memsize I=0; I<FRAME_BUFFER_COUNT; ++I) {
+    State.FrameTimings[I] = {};
+  }
+  State.PendingInputTime = 0;
+  State.InputLatency = {};
 
   NSApplication *App = [NSApplication sharedApplication];
   PathtracerAppDelegate *AppDelegate = [[PathtracerAppDelegate alloc] init];
@@ -350,71 +652,56 @@ int main() {
   glEnable(GL_FRAMEBUFFER_SRGB);
   glEnable(GL_TEXTURE_2D);
 
-  State.TileCount = InitRendering(State.RenderResolution);
-  State.CurrentTileIndex = 0;
-  {
-    std::lock_guard<std::mutex> Lock(State.WorkerMutex);
-    State.WorkerState = worker_state::uninitialized;
-  }
-
+  InitRendering(State.RenderResolution);
   CreateThreads(&State);
+  InitFramePipeline(&State.Pipeline, &State.WorkerPool, FRAME_BUFFER_COUNT);
 
   while(State.Running) {
     ResetGameInputChangeCount(&State.GameInput);
     ProcessOSXMessages(&State.GameInput);
 
-    uusec64 NewFrameTime = GetTime();
-    uusec64 TimeDelta = NewFrameTime - State.LastFrameTime;
-    UpdateGame(&State.Scene, &State.GameInput, TimeDelta);
-
-    if(State.Window.occlusionState & NSWindowOcclusionStateVisible) {
-      #if BENCHMARK
-      uusec64 RenderStartTime = GetTime();
-      #endif
-      Render(&State);
-      #if BENCHMARK
-      printf("Render time: %llu ms\n", (GetTime()-RenderStartTime)/1000);
-      #endif
-
-      glTexImage2D(
-        GL_TEXTURE_2D,
-        0,
-        GL_RGB,
-        State.RenderResolution.Dimension.X,
-        State.RenderResolution.Dimension.Y,
-        0,
-        GL_RGB,
-        GL_UNSIGNED_BYTE,
-        State.RenderBuffer
-      );
-
-      glBegin(GL_QUADS);
-      glTexCoord2f(0.0f, 0.0f);
-      glVertex2f(-1.0f, -1.0f);
-      glTexCoord2f(1.0f, 0.0f);
-      glVertex2f(1.0f, -1.0f);
-      glTexCoord2f(1.0f, 1.0f);
-      glVertex2f(1.0f, 1.0f);
-      glTexCoord2f(0.0f, 1.0f);
-      glVertex2f(-1.0f, 1.0f);
-      glEnd();
-
-      [State.OGLContext flushBuffer];
+    if(HasNewGameInput(&State.GameInput)) {
+      if(State.PendingInputTime == 0) {
+        State.PendingInputTime = GetTime();
+      }
+      CancelRenders(&State);
     }
-    else {
-      usleep(10000);
+
+    // Frames snapshot the scene on submission, so the game can move
+    // on while earlier frames are still being traced.
+    bool Visible = State.Window.occlusionState & NSWindowOcclusionStateVisible;
+    if(!Visible || CanSubmitPipelineFrame(&State.Pipeline)) {
+      uusec64 NewFrameTime = GetTime();
+      uusec64 TimeDelta = NewFrameTime - State.LastFrameTime;
+      UpdateGame(&State.Scene, &State.GameInput, TimeDelta);
+      State.LastFrameTime = NewFrameTime;
+
+      if(Visible) {
+        SubmitRender(&State);
+      }
     }
 
-    State.LastFrameTime = NewFrameTime;
+    pipeline_frame *Frame = TakeFinishedPipelineFrame(&State.Pipeline);
+    if(Frame) {
+      PresentRender(&State, Frame);
+    }
+    else {
+      // Poll input while the workers render.
+      usleep(Visible ? 1000 : 10000);
+    }
   }
 
-  {
-    std::lock_guard<std::mutex> Lock(State.WorkerMutex);
-    State.WorkerState = worker_state::shutdown;
-  }
-  State.SyncEvent.notify_all();
+  TerminateFramePipeline(&State.Pipeline);
+  ReportInputLatency(&State.InputLatency);
 
+#if OUT_OF_CORE_GEOMETRY
+  // The caches live in the worker arenas, so report before those go.
+  ReportGeometryStreamStats(&State.WorkerPool);
+#endif
   DestroyThreads(&State);
+#if OUT_OF_CORE_GEOMETRY
+  CloseGeometryStream(&State.GeometryStream);
+#endif
   TerminateRendering();
 
   DestroyTexture(State.TextureHandle);
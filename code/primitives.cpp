@@ -39,6 +39,62 @@ bool triangle::Intersect(ray Ray, fp32 *Distance) const {
   return true;
 }
 
+void LoadTriangleBatch(triangle_batch *Batch, triangle const *const *Triangles) {
+  for(memsize Lane=0; Lane<SIMD_WIDTH; ++Lane) {
+    v3fp32 const *Vertices = Triangles[Lane]->Vertices;
+    v3fp32 EdgeB = Vertices[1] - Vertices[0];
+    v3fp32 EdgeC = Vertices[2] - Vertices[0];
+    Batch->Vertex0[0][Lane] = Vertices[0].X;
+    Batch->Vertex0[1][Lane] = Vertices[0].Y;
+    Batch->Vertex0[2][Lane] = Vertices[0].Z;
+    Batch->EdgeB[0][Lane] = EdgeB.X;
+    Batch->EdgeB[1][Lane] = EdgeB.Y;
+    Batch->EdgeB[2][Lane] = EdgeB.Z;
+    Batch->EdgeC[0][Lane] = EdgeC.X;
+    Batch->EdgeC[1][Lane] = EdgeC.Y;
+    Batch->EdgeC[2][Lane] = EdgeC.Z;
+  }
+}
+
+static v3fp32x4 LoadV3Lanes(fp32 const (*Source)[SIMD_WIDTH]) {
+  v3fp32x4 Result;
+  Result.X = LoadFP32x4(Source[0]);
+  Result.Y = LoadFP32x4(Source[1]);
+  Result.Z = LoadFP32x4(Source[2]);
+  return Result;
+}
+
+// Computes every lane to the end and collects the scalar early outs in
+// a rejection mask. The comparisons are the same as in
+// triangle::Intersect, so NaN lanes are treated alike.
+ui32 IntersectTriangleBatch(triangle_batch const *Batch, ray Ray, fp32 *Distances) {
+  v3fp32x4 VertexB = LoadV3Lanes(Batch->EdgeB);
+  v3fp32x4 VertexC = LoadV3Lanes(Batch->EdgeC);
+  v3fp32x4 RayDirection = SetV3FP32x4(Ray.Direction);
+  v3fp32x4 RayDirectionCrossVertexC = CrossV3FP32x4(RayDirection, VertexC);
+  fp32x4 KDet = DotV3FP32x4(RayDirectionCrossVertexC, VertexB);
+
+  fp32x4 Zero = SetFP32x4(0.0f);
+  fp32x4 One = SetFP32x4(1.0f);
+  fp32x4 Reject = GreaterFP32x4(KDet, SetFP32x4(-Epsilon));
+  fp32x4 KDetInv = One / KDet;
+  v3fp32x4 RayOrigin = SetV3FP32x4(Ray.Origin) - LoadV3Lanes(Batch->Vertex0);
+
+  fp32x4 BaryU = KDetInv * DotV3FP32x4(RayDirectionCrossVertexC, RayOrigin);
+  Reject = OrFP32x4(Reject, OrFP32x4(GreaterFP32x4(BaryU, One), LessFP32x4(BaryU, Zero)));
+
+  v3fp32x4 RayOriginCrossVertexB = CrossV3FP32x4(RayOrigin, VertexB);
+  fp32x4 BaryV = KDetInv * DotV3FP32x4(RayDirection, RayOriginCrossVertexB);
+  Reject = OrFP32x4(Reject, OrFP32x4(GreaterFP32x4(BaryV, One), LessFP32x4(BaryV, Zero)));
+  Reject = OrFP32x4(Reject, GreaterFP32x4(BaryU + BaryV, One));
+
+  fp32x4 T = KDetInv * DotV3FP32x4(RayOriginCrossVertexB, VertexC);
+  Reject = OrFP32x4(Reject, LessFP32x4(T, SetFP32x4(Epsilon)));
+
+  StoreFP32x4(Distances, T);
+  return ~MaskBitsFP32x4(Reject) & ((1u << SIMD_WIDTH) - 1);
+}
+
 bool sphere::Intersect(ray Ray, fp32 *Distance) const {
   const v3fp32 LocalRayOrigin = Ray.Origin - Pos;
   const fp32 A = Ray.Direction.X * Ray.Direction.X + Ray.Direction.Y * Ray.Direction.Y + Ray.Direction.Z * Ray.Direction.Z;
@@ -1,4 +1,7 @@
+#pragma once
+
 #include "lib/math.h"
+#include "lib/simd.h"
 
 struct ray {
   v3fp32 Origin;
@@ -23,6 +26,21 @@ struct triangle {
   v3fp32 CalcNormal() const;
 };
 
+// SIMD_WIDTH triangles in structure-of-arrays layout, with the edges
+// that triangle::Intersect derives from the vertices precomputed.
+struct triangle_batch {
+  fp32 Vertex0[3][SIMD_WIDTH];
+  fp32 EdgeB[3][SIMD_WIDTH];
+  fp32 EdgeC[3][SIMD_WIDTH];
+};
+
+void LoadTriangleBatch(triangle_batch *Batch, triangle const *const *Triangles);
+
+// Same test as triangle::Intersect, for a whole batch at once. Lanes
+// round exactly like the scalar test. Writes each lane's distance and
+// returns a bit mask of the lanes that hit.
+ui32 IntersectTriangleBatch(triangle_batch const *Batch, ray Ray, fp32 *Distances);
+
 struct sphere {
   memsize ID;
   v3fp32 Pos;
@@ -0,0 +1,502 @@
+#include <chrono>
+#include <new>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "render_server.h"
+
+#define REQUEST_TIMEOUT_SECONDS 10
+
+struct server_request {
+  server_request_type Type;
+  render_job_request Job;
+};
+
+struct server_job {
+  render_job_request Request;
+  tile_layout Layout;
+  tile_buffer Tiles;
+  memsize NextTileIndex;
+  memsize FinishedTileCount;
+  ui64 Sequence;
+  uusec64 SubmitTime;
+  uusec64 StartTime;
+  uusec64 Deadline;
+  bool Done;
+  // Set when the job lost the head of the queue with tiles left, and
+  // cleared once a worker takes one of its tiles again.
+  bool Preempted;
+
+  // Links jobs that still have tiles to hand out.
+  server_job *NextPending;
+};
+
+struct render_server {
+  char const *SocketPath;
+  memsize MaxJobPixelCount;
+  int ListenSocket;
+  worker_pool Pool;
+
+  // Guards everything below.
+  std::mutex Mutex;
+  std::condition_variable WorkEvent;
+  std::condition_variable JobDoneEvent;
+  std::condition_variable ConnectionDoneEvent;
+  server_job *PendingJobs;
+  ui64 NextSequence;
+  memsize ActiveJobCount;
+  // Connection threads still running. The server must outlive them.
+  memsize ConnectionCount;
+  bool ShuttingDown;
+
+  ui64 CompletedJobCount;
+  ui64 PreemptionCount;
+  uusec64 TotalLatency;
+  uusec64 MaxLatency;
+};
+
+static int Connect(char const *SocketPath);
+
+static uusec64 GetTime() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool WriteAll(int Socket, void const *Data, memsize Size) {
+  ui8 const *Bytes = static_cast<ui8 const*>(Data);
+  while(Size != 0) {
+    ssize_t Written = write(Socket, Bytes, Size);
+    if(Written <= 0) {
+      return false;
+    }
+    Bytes += Written;
+    Size -= Written;
+  }
+  return true;
+}
+
+static bool ReadAll(int Socket, void *Data, memsize Size) {
+  ui8 *Bytes = static_cast<ui8*>(Data);
+  while(Size != 0) {
+    ssize_t Read = read(Socket, Bytes, Size);
+    if(Read <= 0) {
+      return false;
+    }
+    Bytes += Read;
+    Size -= Read;
+  }
+  return true;
+}
+
+static bool InitSocketAddress(sockaddr_un *Address, char const *SocketPath) {
+  memset(Address, 0, sizeof(*Address));
+  Address->sun_family = AF_UNIX;
+  if(strlen(SocketPath) >= sizeof(Address->sun_path)) {
+    return false;
+  }
+  strcpy(Address->sun_path, SocketPath);
+  return true;
+}
+
+// Orders jobs by priority, then deadline, then submission.
+static bool RunsBefore(server_job const *A, server_job const *B) {
+  if(A->Request.Priority != B->Request.Priority) {
+    return A->Request.Priority > B->Request.Priority;
+  }
+  if(A->Deadline != B->Deadline) {
+    return A->Deadline < B->Deadline;
+  }
+  return A->Sequence < B->Sequence;
+}
+
+// Takes the next tile of the most urgent pending job. Must hold the
+// server mutex.
+static server_job* TakeTile(render_server *Server, memsize *TileIndex) {
+  server_job **BestLink = &Server->PendingJobs;
+  for(server_job **Link = &Server->PendingJobs; *Link; Link = &(*Link)->NextPending) {
+    if(RunsBefore(*Link, *BestLink)) {
+      BestLink = Link;
+    }
+  }
+
+  server_job *Job = *BestLink;
+  Job->Preempted = false;
+  if(Job->NextTileIndex == 0) {
+    Job->StartTime = GetTime();
+  }
+  *TileIndex = Job->NextTileIndex++;
+  if(Job->NextTileIndex == Job->Layout.TileCount) {
+    *BestLink = Job->NextPending;
+  }
+  return Job;
+}
+
+static void ServeTiles(worker *Worker, void *Data, memsize TaskIndex) {
+  render_server *Server = static_cast<render_server*>(Data);
+
+  render_context Context;
+  Context.Arena = &Worker->Arena;
+  Context.GeometryCache = nullptr;
+  Context.SampleIndex = 0;
+
+  server_job *PreviousJob = nullptr;
+  std::unique_lock<std::mutex> Lock(Server->Mutex);
+  for(;;) {
+    while(!Server->PendingJobs && !(Server->ShuttingDown && Server->ActiveJobCount == 0)) {
+      Server->WorkEvent.wait(Lock);
+    }
+    if(!Server->PendingJobs) {
+      break;
+    }
+
+    memsize TileIndex;
+    server_job *Job = TakeTile(Server, &TileIndex);
+
+    // Switching away from a job that still has tiles left means a more
+    // urgent job arrived and took over at this tile boundary. Every
+    // worker sees the switch, but it is one preemption. PreviousJob may
+    // already be delivered and freed unless it is still pending.
+    if(PreviousJob && PreviousJob != Job) {
+      for(server_job *Pending = Server->PendingJobs; Pending; Pending = Pending->NextPending) {
+        if(Pending == PreviousJob) {
+          if(!Pending->Preempted) {
+            Pending->Preempted = true;
+            Server->PreemptionCount++;
+          }
+          break;
+        }
+      }
+    }
+    PreviousJob = Job;
+
+    Lock.unlock();
+    RenderTile(&Job->Layout, &Job->Tiles, &Job->Request.Scene, TileIndex, &Context);
+    Lock.lock();
+
+    Job->FinishedTileCount++;
+    if(Job->FinishedTileCount == Job->Layout.TileCount) {
+      uusec64 Latency = GetTime() - Job->SubmitTime;
+      Server->CompletedJobCount++;
+      Server->TotalLatency += Latency;
+      Server->MaxLatency = Latency > Server->MaxLatency ? Latency : Server->MaxLatency;
+      Job->Done = true;
+      PreviousJob = nullptr;
+      Server->JobDoneEvent.notify_all();
+    }
+  }
+}
+
+static void ServeRenderJob(render_server *Server, int Socket, render_job_request const &Request) {
+  server_job *Job = new (std::nothrow) server_job;
+  ReleaseAssert(Job != nullptr, "Could not allocate job.");
+  Job->Request = Request;
+  // Pointers from the client's address space are meaningless here.
+  Job->Request.Scene.GeometryStream = nullptr;
+
+  resolution Resolution;
+  Resolution.Dimension = Request.Dimension;
+  InitTileLayout(&Job->Layout, Resolution);
+  InitTileBuffer(&Job->Tiles, &Job->Layout);
+  Job->NextTileIndex = 0;
+  Job->FinishedTileCount = 0;
+  Job->SubmitTime = GetTime();
+  Job->StartTime = Job->SubmitTime;
+  Job->Deadline = Request.DeadlineMilliseconds ? Job->SubmitTime + Request.DeadlineMilliseconds * 1000ull : UINT64_MAX;
+  Job->Done = false;
+  Job->Preempted = false;
+
+  {
+    std::unique_lock<std::mutex> Lock(Server->Mutex);
+    Job->Sequence = Server->NextSequence++;
+    Job->NextPending = Server->PendingJobs;
+    Server->PendingJobs = Job;
+    Server->WorkEvent.notify_all();
+
+    while(!Job->Done) {
+      Server->JobDoneEvent.wait(Lock);
+    }
+  }
+
+  render_job_response Response;
+  Response.Success = true;
+  Response.Dimension = Request.Dimension;
+  Response.QueueTime = Job->StartTime - Job->SubmitTime;
+  Response.TotalTime = GetTime() - Job->SubmitTime;
+  color *Pixels = new (std::nothrow) color[Resolution.CalcCount()];
+  ReleaseAssert(Pixels != nullptr, "Could not allocate job pixels.");
+  SwizzleTileBuffer(&Job->Layout, &Job->Tiles, Pixels);
+  if(WriteAll(Socket, &Response, sizeof(Response))) {
+    WriteAll(Socket, Pixels, sizeof(color) * Resolution.CalcCount());
+  }
+  close(Socket);
+
+  delete[] Pixels;
+  TerminateTileBuffer(&Job->Tiles);
+  TerminateTileLayout(&Job->Layout);
+  delete Job;
+
+  std::lock_guard<std::mutex> Lock(Server->Mutex);
+  Server->ActiveJobCount--;
+  Server->WorkEvent.notify_all();
+}
+
+static void ServeStats(render_server *Server, int Socket) {
+  render_server_stats Stats;
+  {
+    std::lock_guard<std::mutex> Lock(Server->Mutex);
+    Stats.QueueDepth = 0;
+    for(server_job *Job = Server->PendingJobs; Job; Job = Job->NextPending) {
+      Stats.QueueDepth++;
+    }
+    Stats.ActiveJobCount = Server->ActiveJobCount;
+    Stats.CompletedJobCount = Server->CompletedJobCount;
+    Stats.PreemptionCount = Server->PreemptionCount;
+    Stats.MeanLatency = Server->CompletedJobCount ? Server->TotalLatency / Server->CompletedJobCount : 0;
+    Stats.MaxLatency = Server->MaxLatency;
+  }
+  WriteAll(Socket, &Stats, sizeof(Stats));
+  close(Socket);
+}
+
+// The scene is copied verbatim from the socket, so its counts must be
+// checked before any tile indexes the fixed-size arrays with them. The
+// job's buffers are sized by its dimension, which is bounded so that a
+// failed allocation cannot take down the other clients' jobs.
+static bool IsValidJobRequest(render_server const *Server, render_job_request const *Request) {
+  scene const *Scene = &Request->Scene;
+  memsize PixelCount = static_cast<memsize>(Request->Dimension.X) * Request->Dimension.Y;
+  return (
+    PixelCount != 0 && PixelCount <= Server->MaxJobPixelCount &&
+    Scene->TriangleCount <= sizeof(Scene->Triangles) / sizeof(Scene->Triangles[0]) &&
+    Scene->SphereCount <= sizeof(Scene->Spheres) / sizeof(Scene->Spheres[0])
+  );
+}
+
+static void ServeRequest(render_server *Server, int Socket) {
+  // Bounds how long a silent client can hold up shutdown.
+  timeval Timeout = {};
+  Timeout.tv_sec = REQUEST_TIMEOUT_SECONDS;
+  setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+
+  server_request Request;
+  if(!ReadAll(Socket, &Request, sizeof(Request))) {
+    close(Socket);
+    return;
+  }
+
+  switch(Request.Type) {
+    case server_request_type::render: {
+      bool Accepted = IsValidJobRequest(Server, &Request.Job);
+      if(Accepted) {
+        std::lock_guard<std::mutex> Lock(Server->Mutex);
+        Accepted = !Server->ShuttingDown;
+        if(Accepted) {
+          Server->ActiveJobCount++;
+        }
+      }
+      if(Accepted) {
+        ServeRenderJob(Server, Socket, Request.Job);
+      }
+      else {
+        render_job_response Response = {};
+        Response.Success = false;
+        Response.Dimension = Request.Job.Dimension;
+        WriteAll(Socket, &Response, sizeof(Response));
+        close(Socket);
+      }
+      break;
+    }
+    case server_request_type::stats:
+      ServeStats(Server, Socket);
+      break;
+    case server_request_type::shutdown: {
+      {
+        std::lock_guard<std::mutex> Lock(Server->Mutex);
+        Server->ShuttingDown = true;
+        Server->WorkEvent.notify_all();
+      }
+      bool Acknowledged = true;
+      WriteAll(Socket, &Acknowledged, sizeof(Acknowledged));
+      close(Socket);
+
+      // The acceptor checks for shutdown after every connection.
+      int WakeSocket = Connect(Server->SocketPath);
+      if(WakeSocket != -1) {
+        close(WakeSocket);
+      }
+      break;
+    }
+    default:
+      close(Socket);
+      break;
+  }
+}
+
+// Runs on its own thread, so a client that connects and never sends
+// its request only stalls itself.
+static void ServeConnection(render_server *Server, int Socket) {
+  ServeRequest(Server, Socket);
+
+  // Notifying under the lock keeps RunRenderServer from deleting the
+  // server before we are done with it.
+  std::lock_guard<std::mutex> Lock(Server->Mutex);
+  Server->ConnectionCount--;
+  Server->ConnectionDoneEvent.notify_all();
+}
+
+// Runs on its own thread and only accepts; every connection is served
+// on a thread of its own.
+static void AcceptConnections(render_server *Server) {
+  for(;;) {
+    int Socket = accept(Server->ListenSocket, nullptr, nullptr);
+    if(Socket == -1) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> Lock(Server->Mutex);
+    if(Server->ShuttingDown) {
+      close(Socket);
+      return;
+    }
+    Server->ConnectionCount++;
+    std::thread(ServeConnection, Server, Socket).detach();
+  }
+}
+
+bool RunRenderServer(char const *SocketPath, memsize WorkerCount, worker_pool_options Options, memsize MaxJobPixelCount) {
+  sockaddr_un Address;
+  if(!InitSocketAddress(&Address, SocketPath)) {
+    return false;
+  }
+
+  render_server *Server = new (std::nothrow) render_server;
+  ReleaseAssert(Server != nullptr, "Could not allocate render server.");
+  Server->SocketPath = SocketPath;
+  Server->MaxJobPixelCount = MaxJobPixelCount;
+  Server->PendingJobs = nullptr;
+  Server->NextSequence = 0;
+  Server->ActiveJobCount = 0;
+  Server->ConnectionCount = 0;
+  Server->ShuttingDown = false;
+  Server->CompletedJobCount = 0;
+  Server->PreemptionCount = 0;
+  Server->TotalLatency = 0;
+  Server->MaxLatency = 0;
+
+  // Clients that hang up early must not take the daemon down.
+  signal(SIGPIPE, SIG_IGN);
+
+  unlink(SocketPath);
+  Server->ListenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  bool Listening = (
+    Server->ListenSocket != -1 &&
+    bind(Server->ListenSocket, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) == 0 &&
+    listen(Server->ListenSocket, 64) == 0
+  );
+  if(!Listening) {
+    if(Server->ListenSocket != -1) {
+      close(Server->ListenSocket);
+    }
+    delete Server;
+    return false;
+  }
+
+  CreateWorkerPool(&Server->Pool, WorkerCount, Options);
+  std::thread Acceptor(AcceptConnections, Server);
+
+  // Each worker takes exactly one task and keeps serving tiles from it
+  // until shutdown.
+  worker_job Job;
+  Job.Prepare = nullptr;
+  Job.Execute = ServeTiles;
+  Job.Data = Server;
+  Job.TaskCount = WorkerCount;
+  RunWorkerJob(&Server->Pool, Job);
+
+  Acceptor.join();
+  {
+    // Wait for the connection threads to finish sending their results.
+    std::unique_lock<std::mutex> Lock(Server->Mutex);
+    while(Server->ConnectionCount != 0) {
+      Server->ConnectionDoneEvent.wait(Lock);
+    }
+  }
+
+  DestroyWorkerPool(&Server->Pool);
+  close(Server->ListenSocket);
+  unlink(SocketPath);
+  delete Server;
+  return true;
+}
+
+static int Connect(char const *SocketPath) {
+  sockaddr_un Address;
+  if(!InitSocketAddress(&Address, SocketPath)) {
+    return -1;
+  }
+  int Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(Socket == -1) {
+    return -1;
+  }
+  if(connect(Socket, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0) {
+    close(Socket);
+    return -1;
+  }
+  return Socket;
+}
+
+bool SubmitRenderJob(char const *SocketPath, render_job_request const *Request, render_job_response *Response, color *Pixels) {
+  int Socket = Connect(SocketPath);
+  if(Socket == -1) {
+    return false;
+  }
+
+  server_request ServerRequest;
+  ServerRequest.Type = server_request_type::render;
+  ServerRequest.Job = *Request;
+  memsize PixelCount = static_cast<memsize>(Request->Dimension.X) * Request->Dimension.Y;
+  bool Result = (
+    WriteAll(Socket, &ServerRequest, sizeof(ServerRequest)) &&
+    ReadAll(Socket, Response, sizeof(*Response)) &&
+    Response->Success &&
+    ReadAll(Socket, Pixels, sizeof(color) * PixelCount)
+  );
+  close(Socket);
+  return Result;
+}
+
+bool QueryRenderServerStats(char const *SocketPath, render_server_stats *Stats) {
+  int Socket = Connect(SocketPath);
+  if(Socket == -1) {
+    return false;
+  }
+
+  server_request ServerRequest;
+  ServerRequest.Type = server_request_type::stats;
+  bool Result = (
+    WriteAll(Socket, &ServerRequest, sizeof(ServerRequest)) &&
+    ReadAll(Socket, Stats, sizeof(*Stats))
+  );
+  close(Socket);
+  return Result;
+}
+
+bool ShutdownRenderServer(char const *SocketPath) {
+  int Socket = Connect(SocketPath);
+  if(Socket == -1) {
+    return false;
+  }
+
+  server_request ServerRequest;
+  ServerRequest.Type = server_request_type::shutdown;
+  bool Acknowledged = false;
+  bool Result = (
+    WriteAll(Socket, &ServerRequest, sizeof(ServerRequest)) &&
+    ReadAll(Socket, &Acknowledged, sizeof(Acknowledged))
+  );
+  close(Socket);
+  return Result && Acknowledged;
+}
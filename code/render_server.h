@@ -0,0 +1,54 @@
+#pragma once
+
+#include "rendering.h"
+
+// Long running render daemon. Clients submit jobs over a local (unix
+// domain) socket. All jobs share one worker pool, which hands out tiles
+// by priority, then deadline, then submission order. A newly submitted
+// preview therefore preempts a running final render at the next tile
+// boundary.
+
+enum struct server_request_type : ui32 {
+  render,
+  stats,
+  shutdown
+};
+
+struct render_job_request {
+  // Higher priorities are served first.
+  ui32 Priority;
+  // Relative to submission. Zero means no deadline.
+  ui32 DeadlineMilliseconds;
+  v2ui16 Dimension;
+  scene Scene;
+};
+
+struct render_job_response {
+  // False when the server rejected the job. No pixels follow.
+  bool Success;
+  v2ui16 Dimension;
+  uusec64 QueueTime;
+  uusec64 TotalTime;
+};
+
+struct render_server_stats {
+  // Jobs with tiles that are not handed out yet.
+  ui64 QueueDepth;
+  // Jobs accepted but not yet delivered.
+  ui64 ActiveJobCount;
+  ui64 CompletedJobCount;
+  // Times a job with tiles left lost the workers to a more urgent one.
+  ui64 PreemptionCount;
+  uusec64 MeanLatency;
+  uusec64 MaxLatency;
+};
+
+// Blocks until a shutdown request arrives and all accepted jobs are
+// finished. Jobs with more than MaxJobPixelCount pixels are rejected,
+// so that no single request can exhaust the daemon's memory.
+bool RunRenderServer(char const *SocketPath, memsize WorkerCount, worker_pool_options Options, memsize MaxJobPixelCount);
+
+// Client side. Pixels must hold Dimension.X * Dimension.Y colors.
+bool SubmitRenderJob(char const *SocketPath, render_job_request const *Request, render_job_response *Response, color *Pixels);
+bool QueryRenderServerStats(char const *SocketPath, render_server_stats *Stats);
+bool ShutdownRenderServer(char const *SocketPath);
@@ -1,22 +1,36 @@
+#include <algorithm>
+#include <atomic>
 #include <new>
+#include <string.h>
 #include "rendering.h"
 #include "lib/assert.h"
+#include "lib/simd.h"
 
 #define EXPOSURE 20
 #define TILE_SIZE 16
 #define SAMPLE_COUNT 32
 #define BOUNCE_COUNT 1
+#define PACKET_SIZE 4
+#define FRUSTUM_EPSILON 0.001f
+// Generous enough for the 128 byte lines of Apple silicon and for
+// adjacent line prefetching on x86.
+#define CACHE_LINE_SIZE 128
+// Rays per worker task of a batch query.
+#define RAY_QUERY_BATCH_SIZE 256
 
 static const fp32 Inv255 = 1.0f / 255.0f;
 
-struct tile {
-  v2ui16 Pos;
-  v2ui16 Size;
-};
-
 static const v3fp32 ArbitraryDirection = v3fp32::Normalize(v3fp32(15, 1, 67));
-static resolution Resolution;
-static tile *Tiles = nullptr;
+static tile_layout FrameLayout;
+
+// Per-worker rendering state, hung off worker::State. It lives in the
+// worker's own arena together with the scene copy and the geometry
+// cache, so it is first-touched by that worker and goes away with the
+// pool.
+struct render_worker {
+  scene *Scene;
+  geometry_cache *GeometryCache;
+};
 
 enum struct object_type {
   triangle,
@@ -28,6 +42,10 @@ struct object_trace_result {
   object_type Type;
   memsize Index;
   fp32 Distance;
+
+  // Copy of the hit triangle, since streamed chunks may be evicted
+  // before the details are resolved.
+  triangle Triangle;
 };
 
 struct detail_trace_result {
@@ -46,6 +64,14 @@ struct id_trace_result {
 
 scene::scene() {
   TriangleCount = 0;
+  SphereCount = 0;
+  GeometryStream = nullptr;
+  GeometryCacheBudget = 0;
+}
+
+void scene::AttachGeometryStream(geometry_stream const *Stream, memsize CacheBudget) {
+  GeometryStream = Stream;
+  GeometryCacheBudget = CacheBudget;
 }
 
 void scene::AddTriangle(v3fp32 V0, v3fp32 V1, v3fp32 V2, color Albedo) {
@@ -75,34 +101,269 @@ static inline v3fp32 ColorToV3FP32(color C) {
   return Result;
 }
 
-static object_trace_result TraceObject(scene const *Scene, ray Ray) {
-  fp32 ShortestDistance = FP32_MAX;
+// Generates uniformly distributed hemisphere directions around +Z and
+// rotates them by Rotation, SIMD_WIDTH at a time. The random numbers are
+// drawn in the same order as a scalar per-sample loop would draw them.
+static void GenerateHemisphereSamples(v3fp32 *Samples, memsize Count, m33fp32 const &Rotation, random_series *Random) {
+  DebugAssert(Count % SIMD_WIDTH == 0);
 
-  object_trace_result Result = { .Hit = false };
-  fp32 TestDistance;
+  for(memsize Batch=0; Batch<Count; Batch+=SIMD_WIDTH) {
+    fp32 Random1[SIMD_WIDTH];
+    fp32 Random2[SIMD_WIDTH];
+    for(memsize Lane=0; Lane<SIMD_WIDTH; ++Lane) {
+      Random1[Lane] = RandomUnilateral(Random);
+      Random2[Lane] = RandomUnilateral(Random);
+    }
 
-  for(memsize I=0; I<Scene->TriangleCount; ++I) {
-    triangle const *Triangle = Scene->Triangles + I;
+    fp32x4 Z = LoadFP32x4(Random1);
+    fp32x4 Phi = LoadFP32x4(Random2) * static_cast<fp32>(M_PI * 2.0f);
+    fp32x4 R = SqrtFP32x4(SetFP32x4(1.0f) - Z * Z);
+
+    fp32x4 SinPhi, CosPhi;
+    SinCosFP32x4(Phi, &SinPhi, &CosPhi);
+
+    v3fp32x4 Directions;
+    Directions.X = CosPhi * R;
+    Directions.Y = SinPhi * R;
+    Directions.Z = Z;
+    StoreV3FP32x4(Samples + Batch, Rotation * Directions);
+  }
+}
+
+// Side planes through a shared ray origin which enclose a group of
+// rays. The normals point inwards. Degenerate planes (packets that are
+// a single pixel wide or tall) have a zero normal and cull nothing.
+struct ray_frustum {
+  v3fp32 Origin;
+  v3fp32 Normals[4];
+};
+
+// Indices of the primitives a packet can hit.
+struct packet_candidates {
+  memsize *Triangles;
+  memsize TriangleCount;
+  memsize *Spheres;
+  memsize SphereCount;
+};
+
+// Corners must be the directions of the packet's corner rays, in
+// order around the packet.
+static ray_frustum CalcRayFrustum(v3fp32 Origin, v3fp32 const *Corners) {
+  ray_frustum Frustum;
+  Frustum.Origin = Origin;
+
+  v3fp32 Center = Corners[0] + Corners[1] + Corners[2] + Corners[3];
+  for(memsize I=0; I<4; ++I) {
+    v3fp32 Normal = v3fp32::Cross(Corners[I], Corners[(I + 1) % 4]);
+    fp32 Length = Normal.CalcLength();
+    if(Length < FRUSTUM_EPSILON) {
+      Frustum.Normals[I] = v3fp32(0.0f);
+      continue;
+    }
+    Normal /= Length;
+    if(v3fp32::Dot(Normal, Center) < 0) {
+      Normal = -Normal;
+    }
+    Frustum.Normals[I] = Normal;
+  }
+
+  return Frustum;
+}
+
+// True if all points lie further than Margin outside the same plane.
+static bool IsOutsideFrustum(ray_frustum const *Frustum, v3fp32 const *Points, memsize PointCount, fp32 Margin) {
+  fp32 Limit = -(Margin + FRUSTUM_EPSILON);
+  for(memsize P=0; P<4; ++P) {
+    bool AllOutside = true;
+    for(memsize I=0; I<PointCount; ++I) {
+      if(v3fp32::Dot(Frustum->Normals[P], Points[I] - Frustum->Origin) >= Limit) {
+        AllOutside = false;
+        break;
+      }
+    }
+    if(AllOutside) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool IntersectBounds(ray Ray, v3fp32 Min, v3fp32 Max, fp32 MaxDistance) {
+  fp32 Near = 0.0f;
+  fp32 Far = MaxDistance;
+  fp32 Origin[3] = { Ray.Origin.X, Ray.Origin.Y, Ray.Origin.Z };
+  fp32 Direction[3] = { Ray.Direction.X, Ray.Direction.Y, Ray.Direction.Z };
+  fp32 Lower[3] = { Min.X, Min.Y, Min.Z };
+  fp32 Upper[3] = { Max.X, Max.Y, Max.Z };
+  for(memsize Axis=0; Axis<3; ++Axis) {
+    fp32 InvDirection = 1.0f / Direction[Axis];
+    fp32 T0 = (Lower[Axis] - Origin[Axis]) * InvDirection;
+    fp32 T1 = (Upper[Axis] - Origin[Axis]) * InvDirection;
+    Near = MaxFP32(Near, MinFP32(T0, T1));
+    Far = MinFP32(Far, MaxFP32(T0, T1));
+  }
+  return Near <= Far;
+}
+
+static void TraceTriangles(
+  triangle const *Triangles,
+  memsize Count,
+  ray Ray,
+  fp32 *ShortestDistance,
+  object_trace_result *Result
+) {
+  fp32 TestDistance;
+  for(memsize I=0; I<Count; ++I) {
+    triangle const *Triangle = Triangles + I;
     if(Triangle->Intersect(Ray, &TestDistance)) {
-      if(TestDistance < ShortestDistance) {
-        ShortestDistance = TestDistance;
-        Result.Hit = true;
-        Result.Type = object_type::triangle;
-        Result.Index = I;
+      if(TestDistance < *ShortestDistance) {
+        *ShortestDistance = TestDistance;
+        Result->Hit = true;
+        Result->Type = object_type::triangle;
+        Result->Triangle = *Triangle;
+      }
+    }
+  }
+}
+
+// Traces a cached chunk SIMD_WIDTH triangles at a time. Lanes are
+// considered in order, so ties resolve as in TraceTriangles. Scenes
+// held in memory stay on the scalar path: their few triangles would
+// have to be transposed for every ray.
+static void TraceChunkTriangles(
+  cached_geometry_chunk Chunk,
+  memsize Count,
+  ray Ray,
+  fp32 *ShortestDistance,
+  object_trace_result *Result
+) {
+  fp32 Distances[SIMD_WIDTH];
+  for(memsize I=0; I<Count; I+=SIMD_WIDTH) {
+    ui32 HitMask = IntersectTriangleBatch(Chunk.Batches + I / SIMD_WIDTH, Ray, Distances);
+    memsize BatchCount = MinMemsize(SIMD_WIDTH, Count - I);
+    for(memsize Lane=0; Lane<BatchCount; ++Lane) {
+      if(((HitMask >> Lane) & 1) && Distances[Lane] < *ShortestDistance) {
+        *ShortestDistance = Distances[Lane];
+        Result->Hit = true;
+        Result->Type = object_type::triangle;
+        Result->Triangle = Chunk.Triangles[I + Lane];
       }
     }
   }
+}
 
+static void TraceSphere(
+  sphere const *Sphere,
+  memsize Index,
+  ray Ray,
+  fp32 *ShortestDistance,
+  object_trace_result *Result
+) {
+  fp32 TestDistance;
+  if(Sphere->Intersect(Ray, &TestDistance)) {
+    if(TestDistance < *ShortestDistance) {
+      *ShortestDistance = TestDistance;
+      Result->Hit = true;
+      Result->Type = object_type::sphere;
+      Result->Index = Index;
+    }
+  }
+}
+
+// Culls everything that lies entirely outside one of the frustum
+// planes. Returns false when nothing could be culled. Streamed
+// geometry is never culled per packet: every ray already walks the
+// chunk tree, which culls at least as well, and a packet could not
+// keep its nearest-first order.
+static bool CollectPacketCandidates(scene const *Scene, ray_frustum const *Frustum, memory_arena *Arena, packet_candidates *Candidates) {
+  if(Scene->GeometryStream) {
+    return false;
+  }
+
+  Candidates->Triangles = MemoryArenaPushArray(Arena, memsize, Scene->TriangleCount);
+  Candidates->TriangleCount = 0;
+  for(memsize I=0; I<Scene->TriangleCount; ++I) {
+    if(!IsOutsideFrustum(Frustum, Scene->Triangles[I].Vertices, 3, 0.0f)) {
+      Candidates->Triangles[Candidates->TriangleCount++] = I;
+    }
+  }
+
+  Candidates->Spheres = MemoryArenaPushArray(Arena, memsize, Scene->SphereCount);
+  Candidates->SphereCount = 0;
   for(memsize I=0; I<Scene->SphereCount; ++I) {
     sphere const *Sphere = Scene->Spheres + I;
-    if(Sphere->Intersect(Ray, &TestDistance)) {
-      if(TestDistance < ShortestDistance) {
-        ShortestDistance = TestDistance;
-        Result.Hit = true;
-        Result.Type = object_type::sphere;
-        Result.Index = I;
+    if(!IsOutsideFrustum(Frustum, &Sphere->Pos, 1, Sphere->Radius)) {
+      Candidates->Spheres[Candidates->SphereCount++] = I;
+    }
+  }
+
+  return Candidates->TriangleCount != Scene->TriangleCount || Candidates->SphereCount != Scene->SphereCount;
+}
+
+// Walks the chunk tree nearest subtree first, so most chunks behind
+// the first hit are culled by the distance already found. With AnyHit
+// set the walk stops after the first chunk that yields a hit.
+static void TraceGeometryStream(
+  geometry_stream const *Stream,
+  ray Ray,
+  bool AnyHit,
+  fp32 *ShortestDistance,
+  object_trace_result *Result,
+  render_context *Context
+) {
+  if(Stream->NodeCount == 0) {
+    return;
+  }
+
+  fp32 Direction[3] = { Ray.Direction.X, Ray.Direction.Y, Ray.Direction.Z };
+  memsize Stack[GEOMETRY_TREE_MAX_DEPTH];
+  memsize StackSize = 0;
+  memsize NodeIndex = 0;
+  for(;;) {
+    geometry_chunk_node const *Node = Stream->Nodes + NodeIndex;
+    if(IntersectBounds(Ray, Node->BoundsMin, Node->BoundsMax, *ShortestDistance)) {
+      if(Node->SplitAxis != GEOMETRY_NODE_LEAF) {
+        // The second child holds the higher centroids along the axis.
+        memsize Near = NodeIndex + 1;
+        memsize Far = Node->Index;
+        if(Direction[Node->SplitAxis] < 0.0f) {
+          std::swap(Near, Far);
+        }
+        DebugAssert(StackSize < GEOMETRY_TREE_MAX_DEPTH);
+        Stack[StackSize++] = Far;
+        NodeIndex = Near;
+        continue;
+      }
+
+      cached_geometry_chunk Chunk = AcquireGeometryChunk(Context->GeometryCache, Node->Index);
+      TraceChunkTriangles(Chunk, Stream->Chunks[Node->Index].TriangleCount, Ray, ShortestDistance, Result);
+      if(AnyHit && Result->Hit) {
+        return;
       }
     }
+
+    if(StackSize == 0) {
+      return;
+    }
+    NodeIndex = Stack[--StackSize];
+  }
+}
+
+static object_trace_result TraceObjectWithin(scene const *Scene, ray Ray, fp32 MaxDistance, render_context *Context) {
+  fp32 ShortestDistance = MaxDistance;
+
+  object_trace_result Result = { .Hit = false };
+
+  geometry_stream const *Stream = Scene->GeometryStream;
+  if(Stream) {
+    TraceGeometryStream(Stream, Ray, false, &ShortestDistance, &Result, Context);
+  }
+  else {
+    TraceTriangles(Scene->Triangles, Scene->TriangleCount, Ray, &ShortestDistance, &Result);
+  }
+
+  for(memsize I=0; I<Scene->SphereCount; ++I) {
+    TraceSphere(Scene->Spheres + I, I, Ray, &ShortestDistance, &Result);
   }
 
   Result.Distance = ShortestDistance;
@@ -110,8 +371,61 @@ static object_trace_result TraceObject(scene const *Scene, ray Ray) {
   return Result;
 }
 
-static id_trace_result TraceID(scene const *Scene, ray Ray) {
-  object_trace_result ObjectResult = TraceObject(Scene, Ray);
+static object_trace_result TraceObject(scene const *Scene, ray Ray, render_context *Context) {
+  return TraceObjectWithin(Scene, Ray, FP32_MAX, Context);
+}
+
+// Stops at the first hit closer than MaxDistance instead of searching
+// for the closest one. Streamed chunks are still searched as a whole.
+static object_trace_result TraceAnyObjectWithin(scene const *Scene, ray Ray, fp32 MaxDistance, render_context *Context) {
+  fp32 ShortestDistance = MaxDistance;
+
+  object_trace_result Result = { .Hit = false };
+
+  geometry_stream const *Stream = Scene->GeometryStream;
+  if(Stream) {
+    TraceGeometryStream(Stream, Ray, true, &ShortestDistance, &Result, Context);
+  }
+  else {
+    for(memsize I=0; I<Scene->TriangleCount && !Result.Hit; ++I) {
+      TraceTriangles(Scene->Triangles + I, 1, Ray, &ShortestDistance, &Result);
+    }
+  }
+
+  for(memsize I=0; I<Scene->SphereCount && !Result.Hit; ++I) {
+    TraceSphere(Scene->Spheres + I, I, Ray, &ShortestDistance, &Result);
+  }
+
+  Result.Distance = ShortestDistance;
+
+  return Result;
+}
+
+// Same as TraceObject, but only considers the primitives that survived
+// the packet frustum test. Candidates are visited in the same order as
+// TraceObject visits them, so ties resolve equally.
+static object_trace_result TracePacketCandidates(scene const *Scene, ray Ray, packet_candidates const *Candidates) {
+  fp32 ShortestDistance = FP32_MAX;
+
+  object_trace_result Result = { .Hit = false };
+
+  for(memsize I=0; I<Candidates->TriangleCount; ++I) {
+    memsize Index = Candidates->Triangles[I];
+    TraceTriangles(Scene->Triangles + Index, 1, Ray, &ShortestDistance, &Result);
+  }
+
+  for(memsize I=0; I<Candidates->SphereCount; ++I) {
+    memsize Index = Candidates->Spheres[I];
+    TraceSphere(Scene->Spheres + Index, Index, Ray, &ShortestDistance, &Result);
+  }
+
+  Result.Distance = ShortestDistance;
+
+  return Result;
+}
+
+static id_trace_result TraceID(scene const *Scene, ray Ray, render_context *Context) {
+  object_trace_result ObjectResult = TraceObject(Scene, Ray, Context);
   id_trace_result IDResult;
 
   if(!ObjectResult.Hit) {
@@ -122,7 +436,7 @@ static id_trace_result TraceID(scene const *Scene, ray Ray) {
   IDResult.Hit = true;
   switch(ObjectResult.Type) {
     case object_type::triangle: {
-      IDResult.ID = Scene->Triangles[ObjectResult.Index].ID;
+      IDResult.ID = ObjectResult.Triangle.ID;
       break;
     }
     case object_type::sphere: {
@@ -136,8 +450,7 @@ static id_trace_result TraceID(scene const *Scene, ray Ray) {
   return IDResult;
 }
 
-static detail_trace_result TraceDetails(scene const *Scene, ray Ray) {
-  object_trace_result ObjectResult = TraceObject(Scene, Ray);
+static detail_trace_result ResolveDetails(scene const *Scene, ray Ray, object_trace_result const &ObjectResult) {
   detail_trace_result DetailResult;
 
   if(!ObjectResult.Hit) {
@@ -149,7 +462,7 @@ static detail_trace_result TraceDetails(scene const *Scene, ray Ray) {
   DetailResult.Position = Ray.Origin + Ray.Direction * ObjectResult.Distance;
   switch(ObjectResult.Type) {
     case object_type::triangle: {
-      triangle const *Triangle = Scene->Triangles + ObjectResult.Index;
+      triangle const *Triangle = &ObjectResult.Triangle;
       DetailResult.Normal = Triangle->CalcNormal();
       DetailResult.Albedo = Triangle->Albedo;
       DetailResult.Intensity = v3fp32(0.0f);
@@ -171,8 +484,13 @@ static detail_trace_result TraceDetails(scene const *Scene, ray Ray) {
   return DetailResult;
 }
 
-static v3fp32 CalcRadiance(scene const *Scene, ray Ray, memsize Depth) {
-  detail_trace_result ObjectTraceResult = TraceDetails(Scene, Ray);
+static detail_trace_result TraceDetails(scene const *Scene, ray Ray, render_context *Context) {
+  return ResolveDetails(Scene, Ray, TraceObject(Scene, Ray, Context));
+}
+
+static v3fp32 CalcRadiance(scene const *Scene, ray Ray, memsize Depth, render_context *Context);
+
+static v3fp32 CalcSurfaceRadiance(scene const *Scene, detail_trace_result const &ObjectTraceResult, memsize Depth, render_context *Context) {
   if(!ObjectTraceResult.Hit) {
     return v3fp32(0.01f, 0.1f, 0.4f);
   }
@@ -182,7 +500,7 @@ static v3fp32 CalcRadiance(scene const *Scene, ray Ray, memsize Depth) {
   if(v3fp32::Dot(SunPosDifference, ObjectTraceResult.Normal) > 0) {
     v3fp32 SunDirection = v3fp32::Normalize(SunPosDifference);
     ray SunRay = { .Origin = ObjectTraceResult.Position, .Direction = SunDirection };
-    id_trace_result SunTraceResult = TraceID(Scene, SunRay);
+    id_trace_result SunTraceResult = TraceID(Scene, SunRay, Context);
 
     if(!SunTraceResult.Hit) {
       fp32 Attenuation = v3fp32::Dot(ObjectTraceResult.Normal, SunDirection);
@@ -205,7 +523,7 @@ static v3fp32 CalcRadiance(scene const *Scene, ray Ray, memsize Depth) {
       .Origin = ObjectTraceResult.Position,
       .Direction = Direction
     };
-    id_trace_result SphereLightTraceResult = TraceID(Scene, SphereLightRay);
+    id_trace_result SphereLightTraceResult = TraceID(Scene, SphereLightRay, Context);
     if(SphereLightTraceResult.Hit && SphereLightTraceResult.ID == Sphere->ID) {
       fp32 Attenuation = v3fp32::Dot(ObjectTraceResult.Normal, Direction) / (Distance*Distance);
       DirectLight += Sphere->Intensity * Attenuation;
@@ -220,23 +538,17 @@ static v3fp32 CalcRadiance(scene const *Scene, ray Ray, memsize Depth) {
     Rotation.Col3 = ObjectTraceResult.Normal;
     Rotation.Col2 = v3fp32::Cross(Rotation.Col1, Rotation.Col3);
 
+    temp_memory SampleMemory = BeginTempMemory(Context->Arena);
+    v3fp32 *Samples = MemoryArenaPushArray(Context->Arena, v3fp32, SAMPLE_COUNT);
+    GenerateHemisphereSamples(Samples, SAMPLE_COUNT, Rotation, &Context->Random);
+
     ray SampleRay;
     SampleRay.Origin = ObjectTraceResult.Position;
     for(memsize I=0; I<SAMPLE_COUNT; ++I) {
-      fp32 Random1 = drand48();
-      fp32 Random2 = drand48();
-      fp32 R = SqrtFP32(1.0f - Random1 * Random1);
-      fp32 Phi = M_PI * 2.0f * Random2;
-
-      SampleRay.Direction.Set(
-        CosFP32(Phi) * R,
-        SinFP32(Phi) * R,
-        Random1
-      );
-
-      SampleRay.Direction = Rotation * SampleRay.Direction;
-      IndirectLight += CalcRadiance(Scene, SampleRay, Depth + 1) * v3fp32::Dot(ObjectTraceResult.Normal, SampleRay.Direction);
+      SampleRay.Direction = Samples[I];
+      IndirectLight += CalcRadiance(Scene, SampleRay, Depth + 1, Context) * v3fp32::Dot(ObjectTraceResult.Normal, SampleRay.Direction);
     }
+    EndTempMemory(SampleMemory);
     IndirectLight *= (2.0f * M_PI) / SAMPLE_COUNT;
   }
 
@@ -248,21 +560,32 @@ static v3fp32 CalcRadiance(scene const *Scene, ray Ray, memsize Depth) {
   return ReflectedRadiance + ObjectTraceResult.Intensity;
 }
 
-memsize InitRendering(resolution AResolution) {
-  Resolution = AResolution;
+static v3fp32 CalcRadiance(scene const *Scene, ray Ray, memsize Depth, render_context *Context) {
+  return CalcSurfaceRadiance(Scene, TraceDetails(Scene, Ray, Context), Depth, Context);
+}
+
+// Squared distance between the tile center and the image center, in
+// half pixels so that it stays integral.
+static si64 CalcTileCenterDistance(tile const *Tile, resolution Resolution) {
+  si64 DX = 2 * Tile->Pos.X + Tile->Size.X - Resolution.Dimension.X;
+  si64 DY = 2 * Tile->Pos.Y + Tile->Size.Y - Resolution.Dimension.Y;
+  return DX * DX + DY * DY;
+}
 
-  memsize TileHorizontalCount = (Resolution.Dimension.X + TILE_SIZE - 1) / TILE_SIZE;
-  memsize TileVerticalCount = (Resolution.Dimension.Y + TILE_SIZE - 1) / TILE_SIZE;
-  memsize TileCount = TileHorizontalCount * TileVerticalCount;
-  Tiles = new (std::nothrow) tile[TileCount];
-  ReleaseAssert(Tiles != nullptr, "Could not allocate tiles.");
+void InitTileLayout(tile_layout *Layout, resolution Resolution) {
+  Layout->Resolution = Resolution;
+  Layout->HorizontalCount = (Resolution.Dimension.X + TILE_SIZE - 1) / TILE_SIZE;
+  Layout->VerticalCount = (Resolution.Dimension.Y + TILE_SIZE - 1) / TILE_SIZE;
+  Layout->TileCount = Layout->HorizontalCount * Layout->VerticalCount;
+  Layout->Tiles = new (std::nothrow) tile[Layout->TileCount];
+  ReleaseAssert(Layout->Tiles != nullptr, "Could not allocate tiles.");
 
   memsize X = 0, Y = 0;
-  for(memsize I=0; I<TileCount; ++I) {
+  for(memsize I=0; I<Layout->TileCount; ++I) {
     DebugAssert(Y <= Resolution.Dimension.Y);
     DebugAssert(X <= Resolution.Dimension.X);
 
-    tile *Tile = Tiles + I;
+    tile *Tile = Layout->Tiles + I;
     Tile->Pos.Set(X, Y);
     memsize RemainingWidth = Resolution.Dimension.X - X;
     Tile->Size.X = MinMemsize(TILE_SIZE, RemainingWidth);
@@ -277,17 +600,88 @@ memsize InitRendering(resolution AResolution) {
     }
   }
 
-  return TileCount;
+  Layout->CenterFirstOrder = new (std::nothrow) memsize[Layout->TileCount];
+  ReleaseAssert(Layout->CenterFirstOrder != nullptr, "Could not allocate tile order.");
+  for(memsize I=0; I<Layout->TileCount; ++I) {
+    Layout->CenterFirstOrder[I] = I;
+  }
+  tile const *Tiles = Layout->Tiles;
+  std::stable_sort(
+    Layout->CenterFirstOrder,
+    Layout->CenterFirstOrder + Layout->TileCount,
+    [Tiles, Resolution](memsize A, memsize B) {
+      return CalcTileCenterDistance(Tiles + A, Resolution) < CalcTileCenterDistance(Tiles + B, Resolution);
+    }
+  );
+}
+
+void TerminateTileLayout(tile_layout *Layout) {
+  delete[] Layout->Tiles;
+  Layout->Tiles = nullptr;
+  delete[] Layout->CenterFirstOrder;
+  Layout->CenterFirstOrder = nullptr;
+  Layout->TileCount = 0;
+}
+
+memsize InitRendering(resolution Resolution) {
+  InitTileLayout(&FrameLayout, Resolution);
+  return FrameLayout.TileCount;
 }
 
 void TerminateRendering() {
-  delete[] Tiles;
-  Tiles = nullptr;
+  TerminateTileLayout(&FrameLayout);
 }
 
-void RenderTile(color *Buffer, scene const *Scene, memsize TileIndex) {
-  tile *Tile = Tiles + TileIndex;
+// Resolves primary visibility for a packet of at most PACKET_SIZE x
+// PACKET_SIZE rays. Directions and Hits are tile sized and row major
+// with the given stride. Primitives outside the packet frustum are
+// culled once for the whole packet. When nothing can be culled the
+// rays are traced one by one instead.
+static void TracePrimaryPacket(
+  scene const *Scene,
+  v3fp32 const *Directions,
+  memsize Stride,
+  tile const *Packet,
+  render_context *Context,
+  detail_trace_result *Hits
+) {
+  memsize FirstX = Packet->Pos.X;
+  memsize FirstY = Packet->Pos.Y;
+  memsize LastX = FirstX + Packet->Size.X - 1;
+  memsize LastY = FirstY + Packet->Size.Y - 1;
+  v3fp32 Corners[4] = {
+    Directions[FirstY * Stride + FirstX],
+    Directions[FirstY * Stride + LastX],
+    Directions[LastY * Stride + LastX],
+    Directions[LastY * Stride + FirstX]
+  };
+  ray_frustum Frustum = CalcRayFrustum(Scene->Camera.Position, Corners);
 
+  temp_memory CandidateMemory = BeginTempMemory(Context->Arena);
+  packet_candidates Candidates = {};
+  bool Culled = CollectPacketCandidates(Scene, &Frustum, Context->Arena, &Candidates);
+
+  ray Ray = { .Origin = Scene->Camera.Position };
+  for(memsize Y=FirstY; Y<=LastY; ++Y) {
+    for(memsize X=FirstX; X<=LastX; ++X) {
+      memsize Index = Y * Stride + X;
+      Ray.Direction = Directions[Index];
+      if(Culled) {
+        Hits[Index] = ResolveDetails(Scene, Ray, TracePacketCandidates(Scene, Ray, &Candidates));
+      }
+      else {
+        Hits[Index] = TraceDetails(Scene, Ray, Context);
+      }
+    }
+  }
+  EndTempMemory(CandidateMemory);
+}
+
+// Traces one primary ray per pixel of the tile and writes the
+// radiance row by row, with a stride of Tile->Size.X. Primary
+// visibility is resolved in packets first, then every pixel is shaded
+// with its own random series.
+static void CalcTileRadiance(scene const *Scene, resolution Resolution, tile const *Tile, render_context *Context, v3fp32 *Radiance) {
   v3fp32 WorldPlaneCenter = Scene->Camera.Position + Scene->Camera.Direction;
   fp32 WorldPlaneWidth = TanFP32(Scene->Camera.FOV/2.0f)*2.0f;
 
@@ -297,28 +691,64 @@ void RenderTile(color *Buffer, scene const *Scene, memsize TileIndex) {
   ui16 HalfScreenPlaneHeight = ScreenPlaneHeight * 0.5f;
 
   fp32 ScreenToWorldPlaneRatio = static_cast<fp32>(WorldPlaneWidth) / (ScreenPlaneWidth);
-  ray Ray = { .Origin = Scene->Camera.Position };
   v3fp32 Up(0, 1, 0);
 
-  ui32 ScreenPixelYOffset;
+  memsize PixelCount = Tile->Size.X * Tile->Size.Y;
+  temp_memory PrimaryMemory = BeginTempMemory(Context->Arena);
+  v3fp32 *Directions = MemoryArenaPushArray(Context->Arena, v3fp32, PixelCount);
+  detail_trace_result *Hits = MemoryArenaPushArray(Context->Arena, detail_trace_result, PixelCount);
+
+  v3fp32 *Direction = Directions;
   ui16 EndX = Tile->Pos.X + Tile->Size.X;
   ui16 EndY = Tile->Pos.Y + Tile->Size.Y;
   for(ui16 Y=Tile->Pos.Y; Y<EndY; ++Y) {
-    ScreenPixelYOffset = Y * ScreenPlaneWidth;
     fp32 ScreenRowCenterY = 0.5f + (static_cast<si16>(Y) - HalfScreenPlaneHeight);
     v3fp32 WorldRowCenter = WorldPlaneCenter + Up * (ScreenRowCenterY * ScreenToWorldPlaneRatio);
     for(ui16 X=Tile->Pos.X; X<EndX; ++X) {
       fp32 PixelColCenterX = 0.5f + (static_cast<si16>(X) - HalfScreenPlaneWidth);
       v3fp32 WorldPixelPosition = WorldRowCenter + Scene->Camera.Right * (PixelColCenterX * ScreenToWorldPlaneRatio);
       v3fp32 Difference = WorldPixelPosition - Scene->Camera.Position;
-      Ray.Direction = v3fp32::Normalize(Difference);
+      *Direction++ = v3fp32::Normalize(Difference);
+    }
+  }
+
+  for(ui16 Y=0; Y<Tile->Size.Y; Y+=PACKET_SIZE) {
+    for(ui16 X=0; X<Tile->Size.X; X+=PACKET_SIZE) {
+      tile Packet;
+      Packet.Pos.Set(X, Y);
+      Packet.Size.X = MinMemsize(PACKET_SIZE, Tile->Size.X - X);
+      Packet.Size.Y = MinMemsize(PACKET_SIZE, Tile->Size.Y - Y);
+      TracePrimaryPacket(Scene, Directions, Tile->Size.X, &Packet, Context, Hits);
+    }
+  }
+
+  detail_trace_result const *Hit = Hits;
+  for(ui16 Y=Tile->Pos.Y; Y<EndY; ++Y) {
+    for(ui16 X=Tile->Pos.X; X<EndX; ++X) {
+      memsize PixelIndex = static_cast<memsize>(Y) * ScreenPlaneWidth + X;
+      Context->Random = SeedRandomSeries(Context->SampleIndex, PixelIndex);
+      *Radiance++ = CalcSurfaceRadiance(Scene, *Hit++, 0, Context);
+    }
+  }
+  EndTempMemory(PrimaryMemory);
+}
 
-      v3fp32 Radiance = CalcRadiance(Scene, Ray, 0);
-      v3fp32 Brightness = Radiance * EXPOSURE;
-      color *Pixel = Buffer + ScreenPixelYOffset + X;
-      (*Pixel).R = MinMemsize(255, RoundFP32(Brightness.X));
-      (*Pixel).G = MinMemsize(255, RoundFP32(Brightness.Y));
-      (*Pixel).B = MinMemsize(255, RoundFP32(Brightness.Z));
+static color ExposeRadiance(v3fp32 Radiance) {
+  v3fp32 Brightness = Radiance * EXPOSURE;
+  color Result;
+  Result.R = MinMemsize(255, RoundFP32(Brightness.X));
+  Result.G = MinMemsize(255, RoundFP32(Brightness.Y));
+  Result.B = MinMemsize(255, RoundFP32(Brightness.Z));
+  return Result;
+}
+
+// Stride is in colors and negative for images stored top row first.
+static void ExposeTile(v3fp32 const *Radiance, tile const *Tile, color *Destination, si64 Stride) {
+  for(ui16 Y=0; Y<Tile->Size.Y; ++Y) {
+    color *Row = Destination + Y * Stride;
+    for(ui16 X=0; X<Tile->Size.X; ++X) {
+      color *Pixel = Row + X;
+      *Pixel = ExposeRadiance(*Radiance++);
 
       // Temp safe guard:
       DebugAssert((*Pixel).R != 255);
@@ -327,3 +757,528 @@ void RenderTile(color *Buffer, scene const *Scene, memsize TileIndex) {
     }
   }
 }
+
+void RenderTile(tile_layout const *Layout, tile_buffer *Buffer, scene const *Scene, memsize TileIndex, render_context *Context) {
+  tile const *Tile = Layout->Tiles + TileIndex;
+
+  temp_memory TileMemory = BeginTempMemory(Context->Arena);
+  v3fp32 *Radiance = MemoryArenaPushArray(Context->Arena, v3fp32, Tile->Size.X * Tile->Size.Y);
+  CalcTileRadiance(Scene, Layout->Resolution, Tile, Context, Radiance);
+  ExposeTile(Radiance, Tile, Buffer->Pixels + TileIndex * Buffer->TileStride, Tile->Size.X);
+  EndTempMemory(TileMemory);
+}
+
+// Mapped image files are row-major on disk, so their tiles are written
+// in place instead, walking the file's rows backwards.
+static void RenderImageTile(tile_layout const *Layout, mapped_image *Image, scene const *Scene, memsize TileIndex, render_context *Context) {
+  tile const *Tile = Layout->Tiles + TileIndex;
+  si64 Width = Layout->Resolution.Dimension.X;
+
+  temp_memory TileMemory = BeginTempMemory(Context->Arena);
+  v3fp32 *Radiance = MemoryArenaPushArray(Context->Arena, v3fp32, Tile->Size.X * Tile->Size.Y);
+  CalcTileRadiance(Scene, Layout->Resolution, Tile, Context, Radiance);
+  ExposeTile(Radiance, Tile, GetMappedImageRow(Image, Tile->Pos.Y) + Tile->Pos.X, -Width);
+  EndTempMemory(TileMemory);
+}
+
+void InitTileBuffer(tile_buffer *Buffer, tile_layout const *Layout) {
+  // A whole number of cache lines is also a whole number of colors once
+  // the count is a multiple of the line size.
+  Buffer->TileStride = (TILE_SIZE * TILE_SIZE + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  memsize Size = Layout->TileCount * Buffer->TileStride * sizeof(color);
+  Buffer->Allocation = new (std::nothrow) ui8[Size + CACHE_LINE_SIZE - 1];
+  ReleaseAssert(Buffer->Allocation != nullptr, "Could not allocate tile buffer.");
+
+  memsize Address = reinterpret_cast<memsize>(Buffer->Allocation);
+  Address = (Address + CACHE_LINE_SIZE - 1) & ~static_cast<memsize>(CACHE_LINE_SIZE - 1);
+  Buffer->Pixels = reinterpret_cast<color*>(Address);
+}
+
+void TerminateTileBuffer(tile_buffer *Buffer) {
+  delete[] Buffer->Allocation;
+  Buffer->Allocation = nullptr;
+  Buffer->Pixels = nullptr;
+}
+
+// Tile rows are contiguous in both layouts, so each one is a single
+// short memcpy which compiles to a few vector moves.
+void SwizzleTileBuffer(tile_layout const *Layout, tile_buffer const *TileBuffer, color *Buffer) {
+  memsize Width = Layout->Resolution.Dimension.X;
+  for(memsize I=0; I<Layout->TileCount; ++I) {
+    tile const *Tile = Layout->Tiles + I;
+    color const *Source = TileBuffer->Pixels + I * TileBuffer->TileStride;
+    color *Destination = Buffer + Tile->Pos.Y * Width + Tile->Pos.X;
+    memsize RowSize = Tile->Size.X * sizeof(color);
+    for(ui16 Y=0; Y<Tile->Size.Y; ++Y) {
+      memcpy(Destination, Source, RowSize);
+      Source += Tile->Size.X;
+      Destination += Width;
+    }
+  }
+}
+
+void AccumulateTile(tile_layout const *Layout, accumulation_buffer *Accumulation, scene const *Scene, memsize TileIndex, render_context *Context) {
+  tile const *Tile = Layout->Tiles + TileIndex;
+
+  temp_memory TileMemory = BeginTempMemory(Context->Arena);
+  v3fp32 *Radiance = MemoryArenaPushArray(Context->Arena, v3fp32, Tile->Size.X * Tile->Size.Y);
+  CalcTileRadiance(Scene, Layout->Resolution, Tile, Context, Radiance);
+
+  for(ui16 Y=0; Y<Tile->Size.Y; ++Y) {
+    v3fp32 *Row = Accumulation->Sums + (Tile->Pos.Y + Y) * Layout->Resolution.Dimension.X + Tile->Pos.X;
+    for(ui16 X=0; X<Tile->Size.X; ++X) {
+      Row[X] += *Radiance++;
+    }
+  }
+  EndTempMemory(TileMemory);
+}
+
+void InitAccumulationBuffer(accumulation_buffer *Accumulation, resolution AResolution) {
+  Accumulation->Resolution = AResolution;
+  Accumulation->Sums = new (std::nothrow) v3fp32[AResolution.CalcCount()];
+  ReleaseAssert(Accumulation->Sums != nullptr, "Could not allocate accumulation buffer.");
+  Accumulation->FirstSampleIndex = 0;
+  ClearAccumulationBuffer(Accumulation);
+}
+
+void ClearAccumulationBuffer(accumulation_buffer *Accumulation) {
+  memsize PixelCount = Accumulation->Resolution.CalcCount();
+  for(memsize I=0; I<PixelCount; ++I) {
+    Accumulation->Sums[I].Clear();
+  }
+  Accumulation->SampleCount = 0;
+}
+
+void TerminateAccumulationBuffer(accumulation_buffer *Accumulation) {
+  delete[] Accumulation->Sums;
+  Accumulation->Sums = nullptr;
+}
+
+void ResolveAccumulationBuffer(accumulation_buffer const *Accumulation, mapped_image *Image) {
+  DebugAssert(Accumulation->SampleCount != 0);
+  DebugAssert(Image->Dimension.X == Accumulation->Resolution.Dimension.X);
+  DebugAssert(Image->Dimension.Y == Accumulation->Resolution.Dimension.Y);
+  fp32 Weight = 1.0f / Accumulation->SampleCount;
+  memsize Width = Accumulation->Resolution.Dimension.X;
+  for(memsize Y=0; Y<Accumulation->Resolution.Dimension.Y; ++Y) {
+    v3fp32 const *Sums = Accumulation->Sums + Y * Width;
+    color *Row = GetMappedImageRow(Image, Y);
+    for(memsize X=0; X<Width; ++X) {
+      Row[X] = ExposeRadiance(Sums[X] * Weight);
+    }
+  }
+}
+
+struct render_frame_job {
+  scene const *Scene;
+
+  // When set, radiance is added to the accumulation buffer. Finished
+  // tiles of the sums are also copied to Snapshot when that is set.
+  accumulation_buffer *Accumulation;
+  v3fp32 *Snapshot;
+
+  // Otherwise tiles go to the image file. BandTileCounts counts
+  // finished tiles per horizontal band of tiles.
+  mapped_image *Image;
+  std::atomic<memsize> *BandTileCounts;
+};
+
+static render_worker* GetRenderWorker(worker *Worker) {
+  if(Worker->State == nullptr) {
+    render_worker *RenderWorker = MemoryArenaPushStruct(&Worker->Arena, render_worker);
+    RenderWorker->Scene = nullptr;
+    RenderWorker->GeometryCache = nullptr;
+    Worker->State = RenderWorker;
+  }
+  return static_cast<render_worker*>(Worker->State);
+}
+
+// Copies the scene into the worker's replica, creating the replica and
+// the geometry cache on first use.
+static void UpdateRenderWorker(worker *Worker, scene const *Scene) {
+  render_worker *RenderWorker = GetRenderWorker(Worker);
+  if(RenderWorker->Scene == nullptr) {
+    RenderWorker->Scene = MemoryArenaPushStruct(&Worker->Arena, scene);
+  }
+  *RenderWorker->Scene = *Scene;
+
+  geometry_stream const *Stream = Scene->GeometryStream;
+  if(Stream && RenderWorker->GeometryCache == nullptr) {
+    RenderWorker->GeometryCache = MemoryArenaPushStruct(&Worker->Arena, geometry_cache);
+    memsize Budget = Scene->GeometryCacheBudget / Worker->Pool->WorkerCount;
+    InitGeometryCache(RenderWorker->GeometryCache, Stream, Budget, &Worker->Arena);
+  }
+  DebugAssert(!Stream || RenderWorker->GeometryCache->Stream == Stream);
+}
+
+// The tile's sums are still in this worker's cache right after it
+// accumulated them.
+static void CopyTileSums(tile_layout const *Layout, accumulation_buffer const *Accumulation, v3fp32 *Snapshot, memsize TileIndex) {
+  tile const *Tile = Layout->Tiles + TileIndex;
+  memsize Width = Layout->Resolution.Dimension.X;
+  for(ui16 Y=0; Y<Tile->Size.Y; ++Y) {
+    memsize Offset = (Tile->Pos.Y + Y) * Width + Tile->Pos.X;
+    memcpy(Snapshot + Offset, Accumulation->Sums + Offset, Tile->Size.X * sizeof(v3fp32));
+  }
+}
+
+static void PrepareRenderFrameWorker(worker *Worker, void *Data, memsize TaskIndex) {
+  render_frame_job *Job = static_cast<render_frame_job*>(Data);
+  UpdateRenderWorker(Worker, Job->Scene);
+}
+
+static void ExecuteRenderFrameTask(worker *Worker, void *Data, memsize TaskIndex) {
+  render_frame_job *Job = static_cast<render_frame_job*>(Data);
+  render_worker *RenderWorker = GetRenderWorker(Worker);
+
+  render_context Context;
+  Context.Arena = &Worker->Arena;
+  Context.GeometryCache = RenderWorker->GeometryCache;
+  accumulation_buffer *Accumulation = Job->Accumulation;
+  Context.SampleIndex = Accumulation ? Accumulation->FirstSampleIndex + Accumulation->SampleCount : 0;
+  if(Accumulation) {
+    AccumulateTile(&FrameLayout, Accumulation, RenderWorker->Scene, TaskIndex, &Context);
+    if(Job->Snapshot) {
+      CopyTileSums(&FrameLayout, Accumulation, Job->Snapshot, TaskIndex);
+    }
+    return;
+  }
+
+  RenderImageTile(&FrameLayout, Job->Image, RenderWorker->Scene, TaskIndex, &Context);
+  memsize Band = TaskIndex / FrameLayout.HorizontalCount;
+  memsize Finished = Job->BandTileCounts[Band].fetch_add(1, std::memory_order_acq_rel) + 1;
+  if(Finished == FrameLayout.HorizontalCount) {
+    tile const *Tile = FrameLayout.Tiles + TaskIndex;
+    FlushMappedImageRows(Job->Image, Tile->Pos.Y, Tile->Size.Y);
+  }
+}
+
+geometry_cache_stats CollectGeometryCacheStats(worker_pool const *Pool) {
+  geometry_cache_stats Result = {};
+  for(memsize I=0; I<Pool->WorkerCount; ++I) {
+    render_worker const *RenderWorker = static_cast<render_worker const*>(Pool->Workers[I].State);
+    geometry_cache const *Cache = RenderWorker ? RenderWorker->GeometryCache : nullptr;
+    if(Cache) {
+      Result.Hits += Cache->Stats.Hits;
+      Result.Misses += Cache->Stats.Misses;
+      Result.BytesRead += Cache->Stats.BytesRead;
+    }
+  }
+  return Result;
+}
+
+static void RunRenderFrameJob(worker_pool *Pool, render_frame_job *FrameJob) {
+  worker_job Job;
+  Job.Prepare = PrepareRenderFrameWorker;
+  Job.Execute = ExecuteRenderFrameTask;
+  Job.Data = FrameJob;
+  Job.TaskCount = FrameLayout.TileCount;
+  RunWorkerJob(Pool, Job);
+}
+
+#define DISPATCH_TASK_MASK 0xFFFFFFFFull
+
+static ui64 PackDispatch(ui64 Sequence, memsize TaskIndex) {
+  return (Sequence << 32) | TaskIndex;
+}
+
+// Takes the next tile of the oldest frame that has one left.
+static pipeline_frame* TakePipelineTile(frame_pipeline *Pipeline, memsize *TaskIndex) {
+  memsize TaskCount = FrameLayout.TileCount;
+  for(;;) {
+    ui64 Sequence = Pipeline->DispatchSequence.load(std::memory_order_acquire);
+    if(Sequence == Pipeline->PublishedCount.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    pipeline_frame *Frame = Pipeline->Frames + Sequence % Pipeline->FrameCount;
+    ui64 Dispatch = Frame->Dispatch.load(std::memory_order_acquire);
+    while((Dispatch >> 32) == (Sequence & DISPATCH_TASK_MASK) && (Dispatch & DISPATCH_TASK_MASK) < TaskCount) {
+      if(Frame->Dispatch.compare_exchange_weak(Dispatch, Dispatch + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        *TaskIndex = Dispatch & DISPATCH_TASK_MASK;
+        return Frame;
+      }
+    }
+
+    // All tiles are taken, or the slot already holds a newer frame.
+    Pipeline->DispatchSequence.compare_exchange_strong(Sequence, Sequence + 1, std::memory_order_acq_rel);
+  }
+}
+
+static void ExecuteFramePipeline(worker *Worker, void *Data, memsize TaskIndex) {
+  frame_pipeline *Pipeline = static_cast<frame_pipeline*>(Data);
+  render_worker *RenderWorker = GetRenderWorker(Worker);
+
+  bool HasReplica = false;
+  ui64 ReplicaSequence = 0;
+  for(;;) {
+    memsize FrameTaskIndex;
+    pipeline_frame *Frame = TakePipelineTile(Pipeline, &FrameTaskIndex);
+    if(!Frame) {
+      std::unique_lock<std::mutex> Lock(Pipeline->IdleMutex);
+      while(!Pipeline->Stopping && !(Frame = TakePipelineTile(Pipeline, &FrameTaskIndex))) {
+        Pipeline->IdleEvent.wait(Lock);
+      }
+      if(!Frame) {
+        break;
+      }
+    }
+
+    // The slot cannot be reused while one of its tiles is unfinished,
+    // so the frame's scene stays valid until we are done.
+    if(!HasReplica || Frame->Sequence != ReplicaSequence) {
+      UpdateRenderWorker(Worker, &Frame->Scene);
+      HasReplica = true;
+      ReplicaSequence = Frame->Sequence;
+    }
+
+    render_context Context;
+    Context.Arena = &Worker->Arena;
+    Context.GeometryCache = RenderWorker->GeometryCache;
+    Context.SampleIndex = 0;
+    memsize TileIndex = FrameLayout.CenterFirstOrder[FrameTaskIndex];
+    RenderTile(&FrameLayout, &Frame->Buffer, RenderWorker->Scene, TileIndex, &Context);
+
+    // Must be the last access to the frame.
+    Frame->RemainingTileCount.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+void InitFramePipeline(frame_pipeline *Pipeline, worker_pool *Pool, memsize FrameCount) {
+  DebugAssert(FrameCount != 0);
+  Pipeline->Pool = Pool;
+  Pipeline->Frames = new (std::nothrow) pipeline_frame[FrameCount];
+  ReleaseAssert(Pipeline->Frames != nullptr, "Could not allocate pipeline frames.");
+  Pipeline->FrameCount = FrameCount;
+  for(memsize I=0; I<FrameCount; ++I) {
+    pipeline_frame *Frame = Pipeline->Frames + I;
+    InitTileBuffer(&Frame->Buffer, &FrameLayout);
+    Frame->Sequence = 0;
+    Frame->Cancelled = false;
+    Frame->Kept = false;
+    Frame->Dispatch.store(0, std::memory_order_relaxed);
+    Frame->RemainingTileCount.store(0, std::memory_order_relaxed);
+  }
+
+  Pipeline->SubmittedCount = 0;
+  Pipeline->ReleasedCount = 0;
+  Pipeline->PublishedCount.store(0, std::memory_order_relaxed);
+  Pipeline->DispatchSequence.store(0, std::memory_order_relaxed);
+  Pipeline->Stopping = false;
+
+  // One long-running task per worker.
+  worker_job Job;
+  Job.Prepare = nullptr;
+  Job.Execute = ExecuteFramePipeline;
+  Job.Data = Pipeline;
+  Job.TaskCount = Pool->WorkerCount;
+  StartWorkerJob(Pool, Job);
+}
+
+// Returns false if the frame was already cancelled.
+static bool CancelPipelineFrame(frame_pipeline *Pipeline, ui64 Sequence) {
+  pipeline_frame *Frame = Pipeline->Frames + Sequence % Pipeline->FrameCount;
+  if(Frame->Cancelled) {
+    return false;
+  }
+  Frame->Cancelled = true;
+
+  // Workers race us for the remaining tiles; whatever we take off
+  // the dispatch counter is subtracted from the tiles to wait for.
+  memsize TaskCount = FrameLayout.TileCount;
+  ui64 Dispatch = Frame->Dispatch.load(std::memory_order_acquire);
+  ui64 Exhausted = PackDispatch(Sequence, TaskCount);
+  while((Dispatch & DISPATCH_TASK_MASK) < TaskCount) {
+    if(Frame->Dispatch.compare_exchange_weak(Dispatch, Exhausted, std::memory_order_acq_rel, std::memory_order_acquire)) {
+      break;
+    }
+  }
+  memsize Skipped = TaskCount - MinMemsize(Dispatch & DISPATCH_TASK_MASK, TaskCount);
+  Frame->RemainingTileCount.fetch_sub(Skipped, std::memory_order_release);
+  return true;
+}
+
+void TerminateFramePipeline(frame_pipeline *Pipeline) {
+  for(ui64 Sequence=Pipeline->ReleasedCount; Sequence<Pipeline->SubmittedCount; ++Sequence) {
+    CancelPipelineFrame(Pipeline, Sequence);
+  }
+  {
+    std::lock_guard<std::mutex> Lock(Pipeline->IdleMutex);
+    Pipeline->Stopping = true;
+  }
+  Pipeline->IdleEvent.notify_all();
+  WaitForWorkerJob(Pipeline->Pool);
+
+  for(memsize I=0; I<Pipeline->FrameCount; ++I) {
+    TerminateTileBuffer(&Pipeline->Frames[I].Buffer);
+  }
+  delete[] Pipeline->Frames;
+  Pipeline->Frames = nullptr;
+  Pipeline->FrameCount = 0;
+}
+
+bool CanSubmitPipelineFrame(frame_pipeline const *Pipeline) {
+  return Pipeline->SubmittedCount - Pipeline->ReleasedCount < Pipeline->FrameCount;
+}
+
+void SubmitPipelineFrame(frame_pipeline *Pipeline, scene const *Scene) {
+  DebugAssert(CanSubmitPipelineFrame(Pipeline));
+
+  ui64 Sequence = Pipeline->SubmittedCount++;
+  pipeline_frame *Frame = Pipeline->Frames + Sequence % Pipeline->FrameCount;
+  Frame->Sequence = Sequence;
+  Frame->Scene = *Scene;
+  Frame->Cancelled = false;
+  Frame->Kept = false;
+  Frame->RemainingTileCount.store(FrameLayout.TileCount, std::memory_order_relaxed);
+  Frame->Dispatch.store(PackDispatch(Sequence, 0), std::memory_order_release);
+  Pipeline->PublishedCount.store(Sequence + 1, std::memory_order_release);
+
+  // Idle workers check for tiles while holding IdleMutex, so taking it
+  // here makes sure none of them misses the wakeup.
+  {
+    std::lock_guard<std::mutex> Lock(Pipeline->IdleMutex);
+  }
+  Pipeline->IdleEvent.notify_all();
+}
+
+memsize CancelStalePipelineFrames(frame_pipeline *Pipeline) {
+  if(Pipeline->SubmittedCount == Pipeline->ReleasedCount) {
+    return 0;
+  }
+  ui64 Newest = Pipeline->SubmittedCount - 1;
+  Pipeline->Frames[Newest % Pipeline->FrameCount].Kept = true;
+
+  memsize CancelledCount = 0;
+  for(ui64 Sequence=Pipeline->ReleasedCount; Sequence<Newest; ++Sequence) {
+    if(!Pipeline->Frames[Sequence % Pipeline->FrameCount].Kept) {
+      CancelledCount += CancelPipelineFrame(Pipeline, Sequence);
+    }
+  }
+  return CancelledCount;
+}
+
+pipeline_frame* TakeFinishedPipelineFrame(frame_pipeline *Pipeline) {
+  while(Pipeline->ReleasedCount != Pipeline->SubmittedCount) {
+    pipeline_frame *Frame = Pipeline->Frames + Pipeline->ReleasedCount % Pipeline->FrameCount;
+    if(Frame->RemainingTileCount.load(std::memory_order_acquire) != 0) {
+      return nullptr;
+    }
+    if(!Frame->Cancelled) {
+      return Frame;
+    }
+    // Cancelled frames are recycled once their last tile is done.
+    Pipeline->ReleasedCount++;
+  }
+  return nullptr;
+}
+
+void ResolvePipelineFrame(pipeline_frame const *Frame, color *Buffer) {
+  SwizzleTileBuffer(&FrameLayout, &Frame->Buffer, Buffer);
+}
+
+void ReleasePipelineFrame(frame_pipeline *Pipeline, pipeline_frame *Frame) {
+  DebugAssert(Frame == Pipeline->Frames + Pipeline->ReleasedCount % Pipeline->FrameCount);
+  Pipeline->ReleasedCount++;
+}
+
+void AccumulateFrame(worker_pool *Pool, accumulation_buffer *Accumulation, scene const *Scene, v3fp32 *Snapshot) {
+  DebugAssert(Accumulation->Resolution.Dimension.X == FrameLayout.Resolution.Dimension.X);
+  DebugAssert(Accumulation->Resolution.Dimension.Y == FrameLayout.Resolution.Dimension.Y);
+
+  render_frame_job FrameJob;
+  FrameJob.Scene = Scene;
+  FrameJob.Accumulation = Accumulation;
+  FrameJob.Snapshot = Snapshot;
+  FrameJob.Image = nullptr;
+  FrameJob.BandTileCounts = nullptr;
+  RunRenderFrameJob(Pool, &FrameJob);
+  Accumulation->SampleCount++;
+}
+
+void RenderFrameToImage(worker_pool *Pool, mapped_image *Image, scene const *Scene) {
+  DebugAssert(Image->Dimension.X == FrameLayout.Resolution.Dimension.X);
+  DebugAssert(Image->Dimension.Y == FrameLayout.Resolution.Dimension.Y);
+
+  std::atomic<memsize> *BandTileCounts = new (std::nothrow) std::atomic<memsize>[FrameLayout.VerticalCount];
+  ReleaseAssert(BandTileCounts != nullptr, "Could not allocate band counters.");
+  for(memsize I=0; I<FrameLayout.VerticalCount; ++I) {
+    BandTileCounts[I].store(0, std::memory_order_relaxed);
+  }
+
+  render_frame_job FrameJob;
+  FrameJob.Scene = Scene;
+  FrameJob.Accumulation = nullptr;
+  FrameJob.Snapshot = nullptr;
+  FrameJob.Image = Image;
+  FrameJob.BandTileCounts = BandTileCounts;
+  RunRenderFrameJob(Pool, &FrameJob);
+
+  delete[] BandTileCounts;
+}
+
+struct ray_query_job {
+  scene const *Scene;
+  ray_query const *Queries;
+  ray_query_result *Results;
+  memsize QueryCount;
+  ray_query_mode Mode;
+};
+
+static void PrepareRayQueryWorker(worker *Worker, void *Data, memsize TaskIndex) {
+  ray_query_job *Job = static_cast<ray_query_job*>(Data);
+  UpdateRenderWorker(Worker, Job->Scene);
+}
+
+static void ExecuteRayQueryTask(worker *Worker, void *Data, memsize TaskIndex) {
+  ray_query_job *Job = static_cast<ray_query_job*>(Data);
+  render_worker *RenderWorker = GetRenderWorker(Worker);
+  scene const *Scene = RenderWorker->Scene;
+
+  render_context Context;
+  Context.Arena = &Worker->Arena;
+  Context.GeometryCache = RenderWorker->GeometryCache;
+  Context.SampleIndex = 0;
+
+  memsize Begin = TaskIndex * RAY_QUERY_BATCH_SIZE;
+  memsize End = MinMemsize(Begin + RAY_QUERY_BATCH_SIZE, Job->QueryCount);
+  for(memsize I=Begin; I<End; ++I) {
+    ray_query const *Query = Job->Queries + I;
+    object_trace_result ObjectResult;
+    if(Job->Mode == ray_query_mode::any_hit) {
+      ObjectResult = TraceAnyObjectWithin(Scene, Query->Ray, Query->MaxDistance, &Context);
+    }
+    else {
+      ObjectResult = TraceObjectWithin(Scene, Query->Ray, Query->MaxDistance, &Context);
+    }
+
+    ray_query_result *Result = Job->Results + I;
+    detail_trace_result Details = ResolveDetails(Scene, Query->Ray, ObjectResult);
+    Result->Hit = Details.Hit;
+    if(Details.Hit) {
+      Result->ID = Details.ID;
+      Result->Distance = ObjectResult.Distance;
+      Result->Position = Details.Position;
+      Result->Normal = Details.Normal;
+    }
+  }
+}
+
+void TraceRayQueries(worker_pool *Pool, scene const *Scene, ray_query const *Queries, ray_query_result *Results, memsize QueryCount, ray_query_mode Mode) {
+  if(QueryCount == 0) {
+    return;
+  }
+  ray_query_job QueryJob;
+  QueryJob.Scene = Scene;
+  QueryJob.Queries = Queries;
+  QueryJob.Results = Results;
+  QueryJob.QueryCount = QueryCount;
+  QueryJob.Mode = Mode;
+
+  worker_job Job;
+  Job.Prepare = PrepareRayQueryWorker;
+  Job.Execute = ExecuteRayQueryTask;
+  Job.Data = &QueryJob;
+  Job.TaskCount = (QueryCount + RAY_QUERY_BATCH_SIZE - 1) / RAY_QUERY_BATCH_SIZE;
+  RunWorkerJob(Pool, Job);
+}
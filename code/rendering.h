@@ -1,7 +1,12 @@
 #pragma once
 
 #include "lib/math.h"
+#include "lib/memory.h"
+#include "lib/random.h"
 #include "primitives.h"
+#include "geometry_stream.h"
+#include "image_file.h"
+#include "worker_pool.h"
 
 struct camera {
   v3fp32 Position;
@@ -24,19 +29,191 @@ struct scene {
   sphere Spheres[10];
   memsize SphereCount;
 
+  // When set, triangles are traced from the stream instead of from
+  // Triangles. CacheBudget is in bytes and split across the workers.
+  geometry_stream const *GeometryStream;
+  memsize GeometryCacheBudget;
+
   scene();
   void AddTriangle(v3fp32 V0, v3fp32 V1, v3fp32 V2, color Albedo);
   void AddSphere(v3fp32 Position, fp32 Radius, v3fp32 Intensity, color Albedo);
+  void AttachGeometryStream(geometry_stream const *Stream, memsize CacheBudget);
 };
 
 struct resolution {
   v2ui16 Dimension;
 
-  memsize CalcCount() {
-    return Dimension.X * Dimension.Y;
+  memsize CalcCount() const {
+    return static_cast<memsize>(Dimension.X) * Dimension.Y;
   }
 };
 
+struct tile {
+  v2ui16 Pos;
+  v2ui16 Size;
+};
+
+// Splits an image into tiles, in rows from the top left. Tiles of one
+// horizontal band are consecutive.
+struct tile_layout {
+  resolution Resolution;
+  tile *Tiles;
+  memsize TileCount;
+  memsize HorizontalCount;
+  memsize VerticalCount;
+
+  // Tile indices sorted by distance from the image center.
+  memsize *CenterFirstOrder;
+};
+
+// Tile-major color buffer. The pixels of a tile are contiguous, row
+// by row with a stride of the tile's width, and every tile starts on
+// its own cache line. Workers rendering neighbouring tiles therefore
+// never write to the same line.
+struct tile_buffer {
+  color *Pixels;
+  // Colors from the start of one tile to the next.
+  memsize TileStride;
+  ui8 *Allocation;
+};
+
+// One slot of the frame pipeline. Dispatch packs the low half of the
+// frame's sequence number with the index of the next task to hand
+// out, so a worker can never take a tile from a frame that has since
+// been replaced in this slot.
+struct pipeline_frame {
+  ui64 Sequence;
+  scene Scene;
+  tile_buffer Buffer;
+  bool Cancelled;
+  // Spared by an earlier cancellation as the newest frame, so it is
+  // never cancelled (except on termination).
+  bool Kept;
+  std::atomic<ui64> Dispatch;
+  std::atomic<memsize> RemainingTileCount;
+};
+
+// Frames in flight between the platform layer and the workers. The
+// workers run one long job and keep taking tiles from the oldest frame
+// that has some left, so frame N+1 is traced while frame N is resolved
+// and presented. Completion is signalled through the atomic tile
+// counters alone; the main thread polls them instead of waiting on a
+// condition variable. Only idle workers sleep, on IdleEvent.
+struct frame_pipeline {
+  worker_pool *Pool;
+  pipeline_frame *Frames;
+  memsize FrameCount;
+
+  // Only touched by the main thread.
+  ui64 SubmittedCount;
+  ui64 ReleasedCount;
+
+  std::atomic<ui64> PublishedCount;
+  // Oldest frame that may still have tiles to hand out.
+  std::atomic<ui64> DispatchSequence;
+
+  bool Stopping;
+  std::mutex IdleMutex;
+  std::condition_variable IdleEvent;
+};
+
+enum struct ray_query_mode {
+  closest_hit,
+  // Reports the first hit found, which need not be the closest. Enough
+  // for visibility tests, and cheaper since the search stops early.
+  any_hit
+};
+
+// Only hits closer than MaxDistance count. Pass FP32_MAX for an
+// unbounded ray, or the distance to the target (with a normalized
+// direction) for a line-of-sight test.
+struct ray_query {
+  ray Ray;
+  fp32 MaxDistance;
+};
+
+// The fields after Hit are only written when Hit is true.
+struct ray_query_result {
+  bool Hit;
+  memsize ID;
+  fp32 Distance;
+  v3fp32 Position;
+  v3fp32 Normal;
+};
+
+// Running per-pixel radiance sums for progressive rendering. Every
+// pixel has received SampleCount samples, with the sample indices
+// FirstSampleIndex onwards. Renders that must be statistically
+// independent of each other use disjoint index ranges.
+struct accumulation_buffer {
+  resolution Resolution;
+  v3fp32 *Sums;
+  memsize SampleCount;
+  memsize FirstSampleIndex;
+};
+
+struct render_context {
+  memory_arena *Arena;
+  geometry_cache *GeometryCache;
+
+  // Index of the sample being rendered (the pass of an accumulating
+  // render, zero otherwise). Together with the pixel index it seeds
+  // Random, so renders do not depend on thread scheduling.
+  memsize SampleIndex;
+  random_series Random;
+};
+
+void InitTileLayout(tile_layout *Layout, resolution Resolution);
+void TerminateTileLayout(tile_layout *Layout);
+
 memsize InitRendering(resolution Resolution);
-void RenderTile(color *Buffer, scene const *Scene, memsize TileIndex);
+void InitTileBuffer(tile_buffer *Buffer, tile_layout const *Layout);
+void TerminateTileBuffer(tile_buffer *Buffer);
+// Copies the tiles into a row-major image. Only needed when the image
+// is presented or saved.
+void SwizzleTileBuffer(tile_layout const *Layout, tile_buffer const *TileBuffer, color *Buffer);
+
+void RenderTile(tile_layout const *Layout, tile_buffer *Buffer, scene const *Scene, memsize TileIndex, render_context *Context);
+
+// Interactive frame loop. While the pipeline runs it owns the pool.
+void InitFramePipeline(frame_pipeline *Pipeline, worker_pool *Pool, memsize FrameCount);
+// Cancels all frames and waits for the workers to leave.
+void TerminateFramePipeline(frame_pipeline *Pipeline);
+bool CanSubmitPipelineFrame(frame_pipeline const *Pipeline);
+// Snapshots the scene, so the caller may change it right away.
+void SubmitPipelineFrame(frame_pipeline *Pipeline, scene const *Scene);
+// Drops the untaken tiles of every frame not yet handed out by
+// TakeFinishedPipelineFrame, except the newest one. That frame is kept
+// until it finishes, even once newer frames are submitted, so input
+// arriving about once per frame time cannot starve presentation.
+// Returns how many frames were cancelled.
+memsize CancelStalePipelineFrames(frame_pipeline *Pipeline);
+// Returns the oldest frame once all of its tiles are done, or null.
+// Frames come out in submission order; cancelled ones are skipped.
+pipeline_frame* TakeFinishedPipelineFrame(frame_pipeline *Pipeline);
+void ResolvePipelineFrame(pipeline_frame const *Frame, color *Buffer);
+// The frame's buffer is reused for the next submission.
+void ReleasePipelineFrame(frame_pipeline *Pipeline, pipeline_frame *Frame);
+// Renders straight into a mapped image file, flushing each band of
+// tiles once it completes. Only the pages of bands in flight need to
+// be resident.
+void RenderFrameToImage(worker_pool *Pool, mapped_image *Image, scene const *Scene);
+// Sums the cache statistics of the pool's workers. Call it between
+// jobs, before the pool is destroyed.
+geometry_cache_stats CollectGeometryCacheStats(worker_pool const *Pool);
+
+void InitAccumulationBuffer(accumulation_buffer *Accumulation, resolution Resolution);
+void ClearAccumulationBuffer(accumulation_buffer *Accumulation);
+void TerminateAccumulationBuffer(accumulation_buffer *Accumulation);
+void AccumulateTile(tile_layout const *Layout, accumulation_buffer *Accumulation, scene const *Scene, memsize TileIndex, render_context *Context);
+// Adds one sample per pixel. When Snapshot is set, every tile also
+// copies its updated sums there as soon as it is done, so a
+// checkpoint is taken without stalling the workers afterwards.
+void AccumulateFrame(worker_pool *Pool, accumulation_buffer *Accumulation, scene const *Scene, v3fp32 *Snapshot);
+void ResolveAccumulationBuffer(accumulation_buffer const *Accumulation, mapped_image *Image);
+// Traces a batch of rays on the pool and blocks until all results are
+// written; Results[I] belongs to Queries[I]. Uses the same scene and
+// intersection code as the renderer, but allocates nothing per ray.
+// Must not be called while a frame pipeline runs on the pool.
+void TraceRayQueries(worker_pool *Pool, scene const *Scene, ray_query const *Queries, ray_query_result *Results, memsize QueryCount, ray_query_mode Mode);
 void TerminateRendering();
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <thread>
+#include "render_server.h"
+#include "game.h"
+
+#define WORKER_ARENA_SIZE (1024*1024)
+// Larger jobs are rejected. A job holds two 3 byte colors per pixel
+// while it is rendered and delivered, so this is about 100 MB.
+#define MAX_JOB_PIXEL_COUNT (4096*4096)
+
+static void PrintUsage() {
+  fprintf(
+    stderr,
+    "Usage:\n"
+    "  pathtracer_server serve <socket> [thread count]\n"
+    "  pathtracer_server render <socket> <priority> <deadline ms> <width>x<height> <out.ppm>\n"
+    "  pathtracer_server stats <socket>\n"
+    "  pathtracer_server shutdown <socket>\n"
+  );
+}
+
+static int Serve(char const *SocketPath, memsize ThreadCount) {
+  worker_pool_options Options;
+  Options.ArenaSize = WORKER_ARENA_SIZE;
+  Options.PinThreads = false;
+  if(!RunRenderServer(SocketPath, ThreadCount, Options, MAX_JOB_PIXEL_COUNT)) {
+    fprintf(stderr, "Could not listen on %s\n", SocketPath);
+    return 1;
+  }
+  return 0;
+}
+
+static int Render(char const *SocketPath, ui32 Priority, ui32 DeadlineMilliseconds, v2ui16 Dimension, char const *OutputPath) {
+  render_job_request *Request = new render_job_request;
+  Request->Priority = Priority;
+  Request->DeadlineMilliseconds = DeadlineMilliseconds;
+  Request->Dimension = Dimension;
+  InitGame(&Request->Scene);
+
+  color *Pixels = new color[static_cast<memsize>(Dimension.X) * Dimension.Y];
+  render_job_response Response;
+  if(!SubmitRenderJob(SocketPath, Request, &Response, Pixels)) {
+    fprintf(stderr, "Render job failed.\n");
+    return 1;
+  }
+
+  FILE *File = fopen(OutputPath, "wb");
+  if(!File) {
+    fprintf(stderr, "Could not open %s\n", OutputPath);
+    return 1;
+  }
+  // PPM stores the top row first, color buffers the bottom row.
+  fprintf(File, "P6\n%u %u\n255\n", Dimension.X, Dimension.Y);
+  for(memsize Y=Dimension.Y; Y>0; --Y) {
+    fwrite(Pixels + (Y - 1) * Dimension.X, sizeof(color), Dimension.X, File);
+  }
+  fclose(File);
+
+  printf(
+    "priority %u: queued %llu ms, total %llu ms\n",
+    Priority,
+    static_cast<unsigned long long>(Response.QueueTime / 1000),
+    static_cast<unsigned long long>(Response.TotalTime / 1000)
+  );
+
+  delete[] Pixels;
+  delete Request;
+  return 0;
+}
+
+static int Stats(char const *SocketPath) {
+  render_server_stats Stats;
+  if(!QueryRenderServerStats(SocketPath, &Stats)) {
+    fprintf(stderr, "Could not query %s\n", SocketPath);
+    return 1;
+  }
+  printf("queue_depth %llu\n", static_cast<unsigned long long>(Stats.QueueDepth));
+  printf("active_jobs %llu\n", static_cast<unsigned long long>(Stats.ActiveJobCount));
+  printf("completed_jobs %llu\n", static_cast<unsigned long long>(Stats.CompletedJobCount));
+  printf("preemptions %llu\n", static_cast<unsigned long long>(Stats.PreemptionCount));
+  printf("mean_latency_ms %.3f\n", Stats.MeanLatency / 1000.0);
+  printf("max_latency_ms %.3f\n", Stats.MaxLatency / 1000.0);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if(argc >= 3 && strcmp(argv[1], "serve") == 0) {
+    memsize ThreadCount = argc >= 4 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    return Serve(argv[2], ThreadCount ? ThreadCount : 1);
+  }
+  if(argc == 7 && strcmp(argv[1], "render") == 0) {
+    unsigned Width, Height;
+    if(sscanf(argv[5], "%ux%u", &Width, &Height) != 2 || Width == 0 || Height == 0 || Width > UI16_MAX || Height > UI16_MAX) {
+      PrintUsage();
+      return 1;
+    }
+    v2ui16 Dimension;
+    Dimension.Set(Width, Height);
+    return Render(argv[2], atoi(argv[3]), atoi(argv[4]), Dimension, argv[6]);
+  }
+  if(argc == 3 && strcmp(argv[1], "stats") == 0) {
+    return Stats(argv[2]);
+  }
+  if(argc == 3 && strcmp(argv[1], "shutdown") == 0) {
+    if(!ShutdownRenderServer(argv[2])) {
+      fprintf(stderr, "Could not shut down %s\n", argv[2]);
+      return 1;
+    }
+    return 0;
+  }
+
+  PrintUsage();
+  return 1;
+}
@@ -0,0 +1,178 @@
+#include <new>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "worker_pool.h"
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+// Binds the calling thread to one core. OSX does not expose hard
+// affinity, so there the index becomes an affinity tag, which asks the
+// scheduler to keep differently tagged threads on separate caches. On
+// Linux the workers are spread over the cores the process may run on,
+// which need not be numbered from zero (taskset, cgroup cpusets). A
+// failure leaves the thread unpinned, which only costs locality.
+static void PinCurrentThread(memsize WorkerIndex) {
+#if defined(__APPLE__)
+  thread_affinity_policy_data_t Policy = { static_cast<integer_t>(WorkerIndex + 1) };
+  kern_return_t Result = thread_policy_set(
+    pthread_mach_thread_np(pthread_self()),
+    THREAD_AFFINITY_POLICY,
+    reinterpret_cast<thread_policy_t>(&Policy),
+    THREAD_AFFINITY_POLICY_COUNT
+  );
+  if(Result != KERN_SUCCESS) {
+    fprintf(stderr, "Could not tag worker %zu with an affinity.\n", WorkerIndex);
+  }
+#elif defined(__linux__)
+  // Workers inherit the affinity of the thread that created the pool,
+  // so this is the allowed set as long as the worker is not pinned yet.
+  cpu_set_t Allowed;
+  if(sched_getaffinity(0, sizeof(Allowed), &Allowed) != 0) {
+    fprintf(stderr, "Could not query the CPU affinity of worker %zu.\n", WorkerIndex);
+    return;
+  }
+  memsize AllowedCount = CPU_COUNT(&Allowed);
+  if(AllowedCount == 0) {
+    return;
+  }
+
+  memsize Target = WorkerIndex % AllowedCount;
+  memsize CPU = 0;
+  for(memsize Seen=0; CPU<CPU_SETSIZE; ++CPU) {
+    if(CPU_ISSET(CPU, &Allowed)) {
+      if(Seen == Target) {
+        break;
+      }
+      Seen++;
+    }
+  }
+
+  cpu_set_t Set;
+  CPU_ZERO(&Set);
+  CPU_SET(CPU, &Set);
+  int Result = pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set);
+  if(Result != 0) {
+    fprintf(stderr, "Could not pin worker %zu to CPU %zu: %s\n", WorkerIndex, CPU, strerror(Result));
+  }
+#endif
+}
+
+static void WorkerMain(worker *Worker) {
+  worker_pool *Pool = Worker->Pool;
+
+  // Pin before touching the arena, so its pages are placed on the
+  // memory node the worker will run on.
+  if(Pool->Options.PinThreads) {
+    PinCurrentThread(Worker->Index);
+  }
+  InitMemoryArena(&Worker->Arena, Pool->Options.ArenaSize);
+
+  ui64 SeenGeneration = 0;
+  for(;;) {
+    worker_job Job;
+    {
+      std::unique_lock<std::mutex> Lock(Pool->Mutex);
+      while(!Pool->ShuttingDown && Pool->JobGeneration == SeenGeneration) {
+        Pool->WorkEvent.wait(Lock);
+      }
+      if(Pool->ShuttingDown) {
+        break;
+      }
+      SeenGeneration = Pool->JobGeneration;
+      Job = Pool->Job;
+    }
+
+    if(Job.Prepare) {
+      Job.Prepare(Worker, Job.Data, 0);
+    }
+    for(;;) {
+      memsize TaskIndex = Pool->NextTaskIndex.fetch_add(1, std::memory_order_relaxed);
+      if(TaskIndex >= Job.TaskCount) {
+        break;
+      }
+      Job.Execute(Worker, Job.Data, TaskIndex);
+    }
+
+    bool LastWorker;
+    {
+      std::lock_guard<std::mutex> Lock(Pool->Mutex);
+      Pool->FinishedWorkerCount++;
+      LastWorker = Pool->FinishedWorkerCount == Pool->WorkerCount;
+    }
+    if(LastWorker) {
+      Pool->DoneEvent.notify_all();
+    }
+  }
+
+  TerminateMemoryArena(&Worker->Arena);
+}
+
+void CreateWorkerPool(worker_pool *Pool, memsize WorkerCount, worker_pool_options Options) {
+  DebugAssert(WorkerCount != 0);
+
+  Pool->Workers = new (std::nothrow) worker[WorkerCount];
+  ReleaseAssert(Pool->Workers != nullptr, "Could not allocate workers.");
+  Pool->WorkerCount = WorkerCount;
+  Pool->Options = Options;
+  Pool->JobGeneration = 0;
+  // No job in flight.
+  Pool->FinishedWorkerCount = WorkerCount;
+  Pool->ShuttingDown = false;
+  Pool->NextTaskIndex.store(0, std::memory_order_relaxed);
+
+  for(memsize I=0; I<WorkerCount; ++I) {
+    worker *Worker = Pool->Workers + I;
+    Worker->Index = I;
+    Worker->Pool = Pool;
+    Worker->State = nullptr;
+    Worker->Thread = std::thread(WorkerMain, Worker);
+  }
+}
+
+void StartWorkerJob(worker_pool *Pool, worker_job Job) {
+  {
+    std::lock_guard<std::mutex> Lock(Pool->Mutex);
+    DebugAssert(Pool->FinishedWorkerCount == Pool->WorkerCount);
+    Pool->Job = Job;
+    Pool->JobGeneration++;
+    Pool->FinishedWorkerCount = 0;
+    Pool->NextTaskIndex.store(0, std::memory_order_relaxed);
+  }
+  Pool->WorkEvent.notify_all();
+}
+
+// Every worker has to check in, not just the one finishing the last
+// task, so no Prepare callback can still be reading Job.Data when we
+// return.
+void WaitForWorkerJob(worker_pool *Pool) {
+  std::unique_lock<std::mutex> Lock(Pool->Mutex);
+  while(Pool->FinishedWorkerCount != Pool->WorkerCount) {
+    Pool->DoneEvent.wait(Lock);
+  }
+}
+
+void RunWorkerJob(worker_pool *Pool, worker_job Job) {
+  StartWorkerJob(Pool, Job);
+  WaitForWorkerJob(Pool);
+}
+
+void DestroyWorkerPool(worker_pool *Pool) {
+  {
+    std::lock_guard<std::mutex> Lock(Pool->Mutex);
+    Pool->ShuttingDown = true;
+  }
+  Pool->WorkEvent.notify_all();
+
+  for(memsize I=0; I<Pool->WorkerCount; ++I) {
+    Pool->Workers[I].Thread.join();
+  }
+  delete[] Pool->Workers;
+  Pool->Workers = nullptr;
+  Pool->WorkerCount = 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "lib/def.h"
+#include "lib/memory.h"
+
+struct worker_pool;
+
+struct worker {
+  std::thread Thread;
+  memsize Index;
+  memory_arena Arena;
+  worker_pool *Pool;
+  // Owned by whoever runs jobs on the pool, e.g. the renderer's scene
+  // replica. Null until first set, and only touched by the worker
+  // itself while a job runs. It has to live in Arena (or be released
+  // by its owner), since it is dropped with the pool.
+  void *State;
+};
+
+typedef void (*worker_callback)(worker *Worker, void *Data, memsize TaskIndex);
+
+struct worker_job {
+  // Optional. Runs once on every worker before it starts taking tasks.
+  // TaskIndex is unused.
+  worker_callback Prepare;
+  worker_callback Execute;
+  void *Data;
+  memsize TaskCount;
+};
+
+struct worker_pool_options {
+  memsize ArenaSize;
+  bool PinThreads;
+};
+
+struct worker_pool {
+  worker *Workers;
+  memsize WorkerCount;
+  worker_pool_options Options;
+  worker_job Job;
+  ui64 JobGeneration;
+  memsize FinishedWorkerCount;
+  bool ShuttingDown;
+  std::atomic<memsize> NextTaskIndex;
+  std::mutex Mutex;
+  std::condition_variable WorkEvent;
+  std::condition_variable DoneEvent;
+};
+
+void CreateWorkerPool(worker_pool *Pool, memsize WorkerCount, worker_pool_options Options);
+// Blocks until every task has run.
+void RunWorkerJob(worker_pool *Pool, worker_job Job);
+// Non-blocking variant. Only one job can be in flight, and only the
+// thread that started it may wait for it.
+void StartWorkerJob(worker_pool *Pool, worker_job Job);
+void WaitForWorkerJob(worker_pool *Pool);
+void DestroyWorkerPool(worker_pool *Pool);